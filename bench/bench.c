@@ -0,0 +1,414 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Userspace benchmark of the HDSPe pcm data path.
+ * Builds hdspe-pcm.c against the shim in bench/shim and simulates period
+ * interrupts for every port layout, ADAT width, sample format and period.
+ * Results are printed as CSV, one line per configuration.
+ */
+
+#include "hdspe-pcm.c"
+
+#include <math.h>
+#include <time.h>
+
+#define	BENCH_SAMPLES		(1 << 20)	/* Simulated per config. */
+#define	BENCH_MAX_CALLS		(BENCH_SAMPLES / 32)
+
+unsigned int bench_hw_position;
+
+/* DMA buffers are allocated by the benchmark, see main(). */
+int
+hdspe_dma_start(struct sc_info *sc)
+{
+
+	return (0);
+}
+
+void
+hdspe_dma_idle(struct sc_info *sc)
+{
+}
+
+void
+hdspe_dll_reset(struct sc_info *sc)
+{
+}
+
+void
+hdspe_status_update(struct sc_info *sc, uint32_t status1)
+{
+}
+
+/* Port layouts, mirrors chan_map_* in hdspe.c. */
+static struct hdspe_channel bench_layouts[] = {
+	{ HDSPE_CHAN_AIO_LINE,    "aio/line" },
+	{ HDSPE_CHAN_AIO_PHONE,  "aio/phone" },
+	{ HDSPE_CHAN_AIO_AES,      "aio/aes" },
+	{ HDSPE_CHAN_AIO_SPDIF,  "aio/spdif" },
+	{ HDSPE_CHAN_AIO_ADAT,    "aio/adat" },
+	{ HDSPE_CHAN_AIO_ALL,      "aio/all" },
+	{ HDSPE_CHAN_RAY_AES,       "rd/aes" },
+	{ HDSPE_CHAN_RAY_SPDIF,   "rd/spdif" },
+	{ HDSPE_CHAN_RAY_ADAT1,   "rd/adat1" },
+	{ HDSPE_CHAN_RAY_ADAT2,   "rd/adat2" },
+	{ HDSPE_CHAN_RAY_ADAT3,   "rd/adat3" },
+	{ HDSPE_CHAN_RAY_ADAT4,   "rd/adat4" },
+	{ HDSPE_CHAN_RAY_ALL,       "rd/all" },
+	{ 0,                          NULL },
+};
+
+/* One sample rate per ADAT width. */
+static uint32_t bench_speeds[] = { 48000, 96000, 192000, 0 };
+
+static uint64_t bench_calls[BENCH_MAX_CALLS];
+
+static const char *
+bench_format_name(uint32_t format)
+{
+
+	switch (AFMT_ENCODING(format)) {
+	case AFMT_S16_LE:
+		return ("s16le");
+	case AFMT_S24_LE:
+		return ("s24le");
+	case AFMT_F32_LE:
+		return ("f32le");
+	default:
+		return ("s32le");
+	}
+}
+
+/* Straightforward per-sample conversion to the 32 bit DMA format. */
+static uint32_t
+bench_ref_load(const uint8_t *pcm, uint32_t fmt)
+{
+	int32_t s;
+	double d;
+	float f;
+
+	switch (AFMT_ENCODING(fmt)) {
+	case AFMT_S16_LE:
+		s = (int16_t)(pcm[0] | pcm[1] << 8);
+		return ((uint32_t)s * 65536);
+	case AFMT_S24_LE:
+		s = pcm[0] | pcm[1] << 8 | pcm[2] << 16;
+		if (s & 0x800000)
+			s -= 0x1000000;
+		return ((uint32_t)s * 256);
+	case AFMT_F32_LE:
+		memcpy(&f, pcm, sizeof(f));
+		/* Clip out of range values and NaN by sign, truncate. */
+		d = (double)f * 2147483648.0;
+		if (isnan(f))
+			return (signbit(f) ? 0x80000000 : 0x7fffffff);
+		if (d >= 2147483647.0)
+			return (0x7fffffff);
+		if (d <= -2147483648.0)
+			return (0x80000000);
+		return ((uint32_t)(int32_t)d);
+	default:
+		memcpy(&s, pcm, sizeof(s));
+		return ((uint32_t)s);
+	}
+}
+
+/* Straightforward per-sample conversion from the 32 bit DMA format. */
+static void
+bench_ref_store(uint8_t *pcm, uint32_t sample, uint32_t fmt)
+{
+	uint32_t bits;
+	int32_t s;
+	double d;
+	float f;
+
+	s = (int32_t)sample;
+	switch (AFMT_ENCODING(fmt)) {
+	case AFMT_S16_LE:
+		s >>= 16;
+		pcm[0] = s;
+		pcm[1] = s >> 8;
+		break;
+	case AFMT_S24_LE:
+		s >>= 8;
+		pcm[0] = s;
+		pcm[1] = s >> 8;
+		pcm[2] = s >> 16;
+		break;
+	case AFMT_F32_LE:
+		/* Nearest float, then one step towards zero if rounded up. */
+		d = s / 2147483648.0;
+		f = (float)d;
+		if (f > 0 ? f > d : f < d) {
+			memcpy(&bits, &f, sizeof(bits));
+			bits--;
+			memcpy(&f, &bits, sizeof(f));
+		}
+		memcpy(pcm, &f, sizeof(f));
+		break;
+	default:
+		memcpy(pcm, &s, sizeof(s));
+		break;
+	}
+}
+
+/* Bit patterns worth checking in any format, besides a strided sweep. */
+static const uint32_t bench_check_edges[] = {
+	0x00000000, 0x00000001, 0x0000ffff, 0x00010000, 0x007fffff,
+	0x00800000, 0x00ffffff, 0x7fffffff, 0x80000000, 0x80000001,
+	0xffffffff, 0xff800000, 0xff7fffff,
+	0x3f800000, 0xbf800000,			/* +-1.0 */
+	0x3f7fffff, 0xbf7fffff,			/* Just inside +-1.0 */
+	0x40000000, 0xc0000000,			/* +-2.0 */
+	0x7f800000, 0xff800000,			/* +-Inf */
+	0x7fc00000, 0xffc00000, 0x7f800001,	/* NaN */
+	0x30000000, 0x2fffffff, 0xb0000000,	/* +-2^-31 */
+	0x3b800000, 0x3b7fffff,			/* 2^-8 */
+};
+
+#define	BENCH_CHECK_STRIDE	4099		/* Sweep about 1M patterns. */
+#define	BENCH_CHECK_FRAMES	37		/* Not a multiple of blocks. */
+#define	BENCH_CHECK_CHANNELS	8
+
+static uint32_t
+bench_check_pattern(uint64_t i)
+{
+	unsigned int nedges;
+
+	nedges = sizeof(bench_check_edges) / sizeof(bench_check_edges[0]);
+	if (i < nedges)
+		return (bench_check_edges[i]);
+	return ((uint32_t)((i - nedges) * BENCH_CHECK_STRIDE));
+}
+
+/*
+ * Check the sample conversions of every format against the reference
+ * conversions above, through the mux / demux copies. Returns the number of
+ * mismatches.
+ */
+static int
+bench_check(uint32_t *dma)
+{
+	uint8_t pcm[BENCH_CHECK_FRAMES * BENCH_CHECK_CHANNELS * 4];
+	uint8_t out[sizeof(pcm)], ref[4];
+	unsigned int bps, frame, i, j, slot;
+	uint32_t fmt, expected, pattern;
+	uint64_t n, total;
+	int errors, f;
+
+	errors = 0;
+	for (f = 0; hdspe_encodings[f] != 0; f++) {
+		fmt = hdspe_encodings[f];
+		bps = AFMT_BPS(fmt);
+		frame = BENCH_CHECK_CHANNELS * bps;
+		total = sizeof(bench_check_edges) / sizeof(bench_check_edges[0]) +
+		    ((uint64_t)1 << 32) / BENCH_CHECK_STRIDE;
+
+		for (n = 0; n < total; n += BENCH_CHECK_FRAMES *
+		    BENCH_CHECK_CHANNELS) {
+			/* Fill the pcm frames with little endian patterns. */
+			for (i = 0; i < BENCH_CHECK_FRAMES *
+			    BENCH_CHECK_CHANNELS; i++) {
+				pattern = bench_check_pattern(n + i);
+				for (j = 0; j < bps; j++)
+					pcm[i * bps + j] = pattern >> (8 * j);
+			}
+
+			buffer_mux_write(dma, pcm, BENCH_CHECK_FRAMES,
+			    BENCH_CHECK_CHANNELS, BENCH_CHECK_CHANNELS, fmt);
+			for (i = 0; i < BENCH_CHECK_FRAMES; i++) {
+				for (slot = 0; slot < BENCH_CHECK_CHANNELS;
+				    slot++) {
+					expected = bench_ref_load(
+					    pcm + i * frame + slot * bps, fmt);
+					if (dma[slot * HDSPE_CHANBUF_SAMPLES +
+					    i] == expected)
+						continue;
+					if (errors++ < 10)
+						fprintf(stderr, "%s load: "
+						    "0x%08x, expected 0x%08x\n",
+						    bench_format_name(fmt),
+						    dma[slot *
+						    HDSPE_CHANBUF_SAMPLES + i],
+						    expected);
+				}
+			}
+
+			/* Demux the raw patterns as 32 bit DMA samples. */
+			for (i = 0; i < BENCH_CHECK_FRAMES; i++)
+				for (slot = 0; slot < BENCH_CHECK_CHANNELS;
+				    slot++)
+					dma[slot * HDSPE_CHANBUF_SAMPLES + i] =
+					    bench_check_pattern(n + i *
+					    BENCH_CHECK_CHANNELS + slot);
+			buffer_demux_read(dma, out, BENCH_CHECK_FRAMES,
+			    BENCH_CHECK_CHANNELS, BENCH_CHECK_CHANNELS, fmt);
+			for (i = 0; i < BENCH_CHECK_FRAMES *
+			    BENCH_CHECK_CHANNELS; i++) {
+				pattern = bench_check_pattern(n + i);
+				bench_ref_store(ref, pattern, fmt);
+				if (memcmp(out + i * bps, ref, bps) == 0)
+					continue;
+				if (errors++ < 10)
+					fprintf(stderr, "%s store: 0x%08x\n",
+					    bench_format_name(fmt), pattern);
+			}
+		}
+	}
+
+	return (errors);
+}
+
+static uint64_t
+bench_nsec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec);
+}
+
+static int
+bench_cmp(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return ((x > y) - (x < y));
+}
+
+/* Simulate period interrupts of one channel, timing each buffer_copy(). */
+static void
+bench_run(struct sc_info *sc, struct sc_chinfo *ch, const char *layout)
+{
+	unsigned int calls, i, n, frame;
+	uint64_t start, total;
+
+	n = AFMT_CHANNEL(ch->format);
+	frame = n * AFMT_BPS(ch->format);
+	calls = BENCH_SAMPLES / sc->period;
+
+	buffer_plan(ch);
+	ch->copy_valid = 0;
+	bench_hw_position = 0;
+	ch->buffer->readyptr = 0;
+	ch->buffer->freeptr = 0;
+
+	total = 0;
+	for (i = 0; i < calls; i++) {
+		/* Hardware advanced by one period since the last interrupt. */
+		if (ch->dir == PCMDIR_PLAY) {
+			ch->buffer->readyptr = bench_hw_position * frame;
+			ch->buffer->ready = HDSPE_CHANBUF_SAMPLES / 2 * frame;
+		} else {
+			ch->buffer->freeptr = bench_hw_position * frame;
+			ch->buffer->free = HDSPE_CHANBUF_SAMPLES / 2 * frame;
+		}
+		bench_hw_position = (bench_hw_position + sc->period) %
+		    HDSPE_CHANBUF_SAMPLES;
+
+		start = bench_nsec();
+		buffer_copy(ch);
+		bench_calls[i] = bench_nsec() - start;
+		total += bench_calls[i];
+	}
+
+	qsort(bench_calls, calls, sizeof(bench_calls[0]), bench_cmp);
+	printf("%s,%s,%u,%u,%s,%u,%u,%u,%ju,%ju,%ju,%ju,%.1f\n",
+	    layout, ch->dir == PCMDIR_PLAY ? "play" : "rec",
+	    sc->speed, hdspe_adat_width(sc->speed),
+	    bench_format_name(ch->format), n, ch->nsegs,
+	    sc->period, (uintmax_t)bench_calls[0],
+	    (uintmax_t)bench_calls[calls / 2],
+	    (uintmax_t)bench_calls[calls - calls / 100 - 1],
+	    (uintmax_t)bench_calls[calls - 1],
+	    total > 0 ? (double)calls * sc->period * frame * 1000 / total : 0);
+}
+
+int
+main(int argc, char **argv)
+{
+	struct sc_info sc;
+	struct sc_pcminfo scp;
+	struct sc_chinfo *ch;
+	struct snd_dbuf buffer;
+	struct hdspe_channel *hc;
+	uint32_t *speed;
+	int dir, fmt, i;
+
+	memset(&sc, 0, sizeof(sc));
+	memset(&scp, 0, sizeof(scp));
+	memset(&buffer, 0, sizeof(buffer));
+	sc.lookahead = 1;
+	sc.pbuf = calloc(HDSPE_MAX_SLOTS, HDSPE_CHANBUF_SIZE);
+	sc.rbuf = calloc(HDSPE_MAX_SLOTS, HDSPE_CHANBUF_SIZE);
+	scp.sc = &sc;
+	ch = &scp.chan[0];
+	ch->parent = &scp;
+	ch->buffer = &buffer;
+	ch->data = calloc(hdspe_channel_count(HDSPE_CHAN_RAY_ALL, 8),
+	    HDSPE_CHANBUF_SIZE);
+	if (sc.pbuf == NULL || sc.rbuf == NULL || ch->data == NULL)
+		return (1);
+
+	/* No timing of wrong results. */
+	if (bench_check(sc.pbuf) != 0) {
+		fprintf(stderr, "bench: sample conversion check failed\n");
+		return (1);
+	}
+
+	printf("layout,dir,speed,adat_width,format,channels,segments,period,"
+	    "ns_min,ns_median,ns_p99,ns_max,mbytes_per_s\n");
+
+	for (hc = bench_layouts; hc->descr != NULL; hc++) {
+		for (dir = PCMDIR_REC; dir <= PCMDIR_PLAY; dir += 2) {
+			ch->dir = dir;
+			if (dir == PCMDIR_PLAY)
+				ch->ports = hdspe_channel_play_ports(hc);
+			else
+				ch->ports = hdspe_channel_rec_ports(hc);
+			if (ch->ports == 0)
+				continue;
+
+			for (speed = bench_speeds; *speed != 0; speed++) {
+				sc.speed = *speed;
+				for (fmt = 0; hdspe_encodings[fmt] != 0; fmt++) {
+					ch->format = SND_FORMAT(
+					    hdspe_encodings[fmt],
+					    hdspe_channel_count(ch->ports,
+					    hdspe_adat_width(sc.speed)), 0);
+					for (i = 0; latency_map[i].period != 0;
+					    i++) {
+						sc.period =
+						    latency_map[i].period;
+						bench_run(&sc, ch, hc->descr);
+					}
+				}
+			}
+		}
+	}
+
+	return (0);
+}
@@ -0,0 +1 @@
+/* Empty, hdspe-pcm.c needs nothing from this header in the benchmark. */
@@ -0,0 +1,393 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Thin userspace shim of the sound(4), bus_space and kobj interfaces used by
+ * hdspe-pcm.c, just enough to build and run its data path off-hardware.
+ */
+
+#ifndef _BENCH_SHIM_SOUND_H_
+#define _BENCH_SHIM_SOUND_H_
+
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/time.h>
+
+#ifndef MIN
+#define	MIN(a, b)	(((a) < (b)) ? (a) : (b))
+#endif
+#ifndef MAX
+#define	MAX(a, b)	(((a) > (b)) ? (a) : (b))
+#endif
+#define	__unused	__attribute__((__unused__))
+
+/* Kernel malloc(9), backed by libc. */
+struct malloc_type {
+	const char	*name;
+};
+#define	MALLOC_DEFINE(type, shortdesc, longdesc)			\
+	struct malloc_type type[1] = { { shortdesc } }
+#define	M_NOWAIT	0x0001
+#define	M_WAITOK	0x0002
+#define	M_ZERO		0x0100
+#define	M_DEVBUF	NULL
+#define	M_TEMP		NULL
+#define	malloc(size, type, flags)	((void)(type), calloc(1, (size)))
+#define	free(addr, type)		((void)(type), (free)(addr))
+
+/* Locking, single threaded. */
+struct mtx { int mtx_unused; };
+
+static inline void
+snd_mtxlock(struct mtx *m)
+{
+}
+
+static inline void
+snd_mtxunlock(struct mtx *m)
+{
+}
+
+/* libkern */
+static inline int
+fls(int mask)
+{
+
+	return (mask == 0 ? 0 : 32 - __builtin_clz(mask));
+}
+
+static inline int
+flsll(long long mask)
+{
+
+	return (mask == 0 ? 0 : 64 - __builtin_clzll(mask));
+}
+
+/* Atomics, single threaded. */
+static inline uint32_t
+atomic_load_acq_32(volatile uint32_t *p)
+{
+
+	return (*p);
+}
+
+static inline void
+atomic_set_32(volatile uint32_t *p, uint32_t v)
+{
+
+	*p |= v;
+}
+
+static inline void
+atomic_clear_32(volatile uint32_t *p, uint32_t v)
+{
+
+	*p &= ~v;
+}
+
+/* Devices. */
+struct bench_device {
+	void		*ivars;
+	uint32_t	flags;
+};
+typedef struct bench_device *device_t;
+struct cdev;
+
+static inline int
+device_printf(device_t dev, const char *fmt, ...)
+{
+	va_list ap;
+	int ret;
+
+	va_start(ap, fmt);
+	ret = vfprintf(stderr, fmt, ap);
+	va_end(ap);
+
+	return (ret);
+}
+
+static inline const char *
+device_get_nameunit(device_t dev)
+{
+
+	return ("hdspe0");
+}
+
+static inline void
+devctl_notify(const char *system, const char *subsystem, const char *type,
+    const char *data)
+{
+}
+
+static inline void *
+device_get_ivars(device_t dev)
+{
+
+	return (dev->ivars);
+}
+
+static inline void
+device_set_desc_copy(device_t dev, const char *desc)
+{
+}
+
+/* Register access, the status register reports bench_hw_position. */
+typedef uintptr_t bus_space_tag_t;
+typedef uintptr_t bus_space_handle_t;
+extern unsigned int bench_hw_position;
+
+static inline uint32_t
+bus_space_read_4(bus_space_tag_t t, bus_space_handle_t h, int reg)
+{
+
+	return (reg == 0 ? bench_hw_position * 4 : 0);
+}
+#define	bus_space_read_1(t, h, reg)	((uint8_t)bus_space_read_4(t, h, reg))
+#define	bus_space_read_2(t, h, reg)	((uint16_t)bus_space_read_4(t, h, reg))
+
+static inline void
+bus_space_write_4(bus_space_tag_t t, bus_space_handle_t h, int reg,
+    uint32_t data)
+{
+}
+#define	bus_space_write_1(t, h, reg, data)	bus_space_write_4(t, h, reg, data)
+#define	bus_space_write_2(t, h, reg, data)	bus_space_write_4(t, h, reg, data)
+
+struct resource;
+
+static inline uintmax_t
+rman_get_start(struct resource *r)
+{
+
+	return (0);
+}
+
+typedef uint64_t bus_addr_t;
+typedef uintptr_t vm_offset_t;
+typedef void *bus_dma_tag_t;
+typedef void *bus_dmamap_t;
+
+/* Sound formats and channels. */
+#define	AFMT_S16_LE		0x00000010
+#define	AFMT_S32_LE		0x00001000
+#define	AFMT_S24_LE		0x00010000
+#define	AFMT_F32_LE		0x10000000
+#define	AFMT_CHANNEL_SHIFT	20
+#define	AFMT_CHANNEL(v)		(((v) >> AFMT_CHANNEL_SHIFT) & 0x3f)
+#define	AFMT_ENCODING(v)	((v) & 0xf00fffff)
+#define	AFMT_BIT(v)		(((v) & (AFMT_S32_LE | AFMT_F32_LE)) ? 32 :	\
+				    (((v) & AFMT_S24_LE) ? 24 : 16))
+#define	AFMT_BPS(v)		(AFMT_BIT(v) >> 3)
+#define	SND_FORMAT(f, c, e)	((f) | ((c) << AFMT_CHANNEL_SHIFT))
+
+#define	PCMDIR_PLAY		1
+#define	PCMDIR_REC		-1
+#define	PCMTRIG_START		1
+#define	PCMTRIG_EMLDMAWR	2
+#define	PCMTRIG_EMLDMARD	3
+#define	PCMTRIG_STOP		0
+#define	PCMTRIG_ABORT		-1
+
+#define	SOUND_MASK_VOLUME	(1 << 0)
+#define	SOUND_MASK_PCM		(1 << 4)
+#define	SOUND_MASK_RECLEV	(1 << 11)
+#define	SOUND_MIXER_VOLUME	0
+#define	SOUND_MIXER_RECLEV	11
+
+#define	SND_STATUSLEN		64
+#define	SD_F_MPSAFE		0x00000004
+#define	SD_F_BITPERFECT		0x00000010
+#define	PCM_SOFTC_SIZE		0
+#define	PCM_KLDSTRING(x)	("kld " #x)
+#define	SOUND_MINVER		1
+#define	SOUND_PREFVER		1
+#define	SOUND_MAXVER		1
+
+struct pcmchan_caps {
+	uint32_t	minspeed, maxspeed;
+	uint32_t	*fmtlist;
+	uint32_t	caps;
+};
+
+/* Channel buffer, positions are set up by the benchmark. */
+struct snd_dbuf {
+	unsigned int	readyptr;
+	unsigned int	ready;
+	unsigned int	freeptr;
+	unsigned int	free;
+	unsigned int	blksz;
+};
+
+static inline unsigned int
+sndbuf_getreadyptr(struct snd_dbuf *b)
+{
+
+	return (b->readyptr);
+}
+
+static inline unsigned int
+sndbuf_getready(struct snd_dbuf *b)
+{
+
+	return (b->ready);
+}
+
+static inline unsigned int
+sndbuf_getfreeptr(struct snd_dbuf *b)
+{
+
+	return (b->freeptr);
+}
+
+static inline unsigned int
+sndbuf_getfree(struct snd_dbuf *b)
+{
+
+	return (b->free);
+}
+
+static inline unsigned int
+sndbuf_getblksz(struct snd_dbuf *b)
+{
+
+	return (b->blksz);
+}
+
+static inline int
+sndbuf_setup(struct snd_dbuf *b, void *buf, unsigned int size)
+{
+
+	return (0);
+}
+
+static inline int
+sndbuf_resize(struct snd_dbuf *b, unsigned int blkcnt, unsigned int blksz)
+{
+
+	b->blksz = blksz;
+	return (0);
+}
+
+/* PCM and mixer registration, no-ops. */
+struct pcm_channel;
+struct snd_mixer;
+
+static inline void
+chn_intr(struct pcm_channel *c)
+{
+}
+
+static inline void *
+mix_getdevinfo(struct snd_mixer *m)
+{
+
+	return (m);
+}
+
+static inline void
+mix_setdevs(struct snd_mixer *m, uint32_t mask)
+{
+}
+
+static inline int
+mixer_init(device_t dev, void *cls, void *devinfo)
+{
+
+	return (0);
+}
+
+static inline int
+pcm_register(device_t dev, void *devinfo, int play, int rec)
+{
+
+	return (0);
+}
+
+static inline int
+pcm_unregister(device_t dev)
+{
+
+	return (0);
+}
+
+static inline int
+pcm_addchan(device_t dev, int dir, void *cls, void *devinfo)
+{
+
+	return (0);
+}
+
+static inline uint32_t
+pcm_getflags(device_t dev)
+{
+
+	return (dev->flags);
+}
+
+static inline void
+pcm_setflags(device_t dev, uint32_t val)
+{
+
+	dev->flags = val;
+}
+
+static inline int
+pcm_setstatus(device_t dev, char *str)
+{
+
+	return (0);
+}
+
+/* Method tables, not dispatched in the benchmark. */
+typedef void *kobj_t;
+typedef struct {
+	const char	*name;
+	void		*func;
+} kobj_method_t, device_method_t;
+typedef struct {
+	const char	*name;
+	device_method_t	*methods;
+	size_t		size;
+} driver_t;
+#define	KOBJMETHOD(name, func)	{ #name, (void *)(func) }
+#define	KOBJMETHOD_END		{ NULL, NULL }
+#define	DEVMETHOD(name, func)	{ #name, (void *)(func) }
+#define	CHANNEL_DECLARE(name)						\
+	static kobj_method_t *name##_class __unused = name##_methods
+#define	MIXER_DECLARE(name)						\
+	static kobj_method_t *name##_class __unused = name##_methods
+#define	DRIVER_MODULE(name, busname, driver, evh, arg)			\
+	static driver_t *name##_driver_ptr __unused = &(driver)
+#define	MODULE_DEPEND(module, mdepend, vmin, vpref, vmax)
+#define	MODULE_VERSION(module, version)
+
+#endif /* _BENCH_SHIM_SOUND_H_ */
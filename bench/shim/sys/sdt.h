@@ -0,0 +1,49 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _BENCH_SHIM_SDT_H_
+#define _BENCH_SHIM_SDT_H_
+
+/* DTrace probes compile away in the benchmark. */
+#define	SDT_PROVIDER_DECLARE(prov)					\
+	extern int sdt_provider_##prov
+#define	SDT_PROBE_DEFINE1(prov, mod, func, name, a0)			\
+	extern int sdt_probe_##prov##_##func##_##name
+#define	SDT_PROBE_DEFINE2(prov, mod, func, name, a0, a1)		\
+	extern int sdt_probe_##prov##_##func##_##name
+#define	SDT_PROBE_DEFINE3(prov, mod, func, name, a0, a1, a2)		\
+	extern int sdt_probe_##prov##_##func##_##name
+#define	SDT_PROBE_DEFINE4(prov, mod, func, name, a0, a1, a2, a3)	\
+	extern int sdt_probe_##prov##_##func##_##name
+#define	SDT_PROBE1(prov, mod, func, name, a0)				\
+	do { (void)(a0); } while (0)
+#define	SDT_PROBE2(prov, mod, func, name, a0, a1)			\
+	do { (void)(a0); (void)(a1); } while (0)
+#define	SDT_PROBE3(prov, mod, func, name, a0, a1, a2)			\
+	do { (void)(a0); (void)(a1); (void)(a2); } while (0)
+#define	SDT_PROBE4(prov, mod, func, name, a0, a1, a2, a3)		\
+	do { (void)(a0); (void)(a1); (void)(a2); (void)(a3); } while (0)
+
+#endif
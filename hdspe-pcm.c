@@ -31,6 +31,14 @@
  * Supported cards: AIO, RayDAT.
  */
 
+#include <sys/types.h>
+#include <sys/counter.h>
+#include <sys/sdt.h>
+#include <sys/seqc.h>
+#include <sys/taskqueue.h>
+
+#include <machine/cpu.h>
+
 #include <dev/sound/pcm/sound.h>
 #include <hdspe.h>
 #include <dev/sound/chip.h>
@@ -42,6 +50,45 @@
 
 #define HDSPE_MATRIX_MAX	8
 
+SDT_PROBE_DEFINE3(hdspe, , pcm_intr, chan, "struct sc_pcminfo *",
+    "struct sc_chinfo *", "int");
+SDT_PROBE_DEFINE4(hdspe, , buffer, mux, "uint32_t", "uint32_t",
+    "unsigned int", "unsigned int");
+SDT_PROBE_DEFINE4(hdspe, , buffer, demux, "uint32_t", "uint32_t",
+    "unsigned int", "unsigned int");
+SDT_PROBE_DEFINE2(hdspe, , chan, trigger, "struct sc_chinfo *", "int");
+SDT_PROBE_DEFINE1(hdspe, , chan, free, "struct sc_chinfo *");
+SDT_PROBE_DEFINE2(hdspe, , chan, setformat, "struct sc_chinfo *",
+    "uint32_t");
+SDT_PROBE_DEFINE3(hdspe, , chan, setspeed, "struct sc_chinfo *",
+    "uint32_t", "uint32_t");
+SDT_PROBE_DEFINE4(hdspe, , chan, setblocksize, "struct sc_chinfo *",
+    "uint32_t", "uint32_t", "uint32_t");
+SDT_PROBE_DEFINE2(hdspe, , chan, getcaps, "struct sc_chinfo *",
+    "uint32_t");
+SDT_PROBE_DEFINE4(hdspe, , mixer, set, "struct sc_pcminfo *",
+    "unsigned int", "unsigned int", "unsigned int");
+
+/*
+ * Frames per block when transposing between interleaved pcm and planar DMA
+ * buffers. The block transpose is left to the compiler.
+ */
+#define HDSPE_MUX_BLOCK		4
+
+/*
+ * Sample formats widened or narrowed in the copy loops, preferred first.
+ * 24 bit samples in 32 bit words are already covered by AFMT_S32_LE.
+ */
+static uint32_t hdspe_encodings[] = {
+	AFMT_S32_LE,
+	AFMT_S24_LE,
+	AFMT_S16_LE,
+#ifdef AFMT_F32_LE
+	AFMT_F32_LE,
+#endif
+	0
+};
+
 struct hdspe_latency {
 	uint32_t n;
 	uint32_t period;
@@ -321,9 +368,7 @@ hdspemixer_set(struct snd_mixer *m, unsigned dev,
 
 	scp = mix_getdevinfo(m);
 
-#if 1
-	device_printf(scp->dev, "hdspemixer_set() %d %d\n", left, right);
-#endif
+	SDT_PROBE4(hdspe, , mixer, set, scp, dev, left, right);
 
 	for (i = 0; i < scp->chnum; i++) {
 		ch = &scp->chan[i];
@@ -364,6 +409,10 @@ hdspechan_enable(struct sc_chinfo *ch, int value)
 		reg = HDSPE_IN_ENABLE_BASE;
 
 	ch->run = value;
+	if (value)
+		atomic_set_32(&sc->running, ch->runbit);
+	else
+		atomic_clear_32(&sc->running, ch->runbit);
 
 	/* Iterate through rows of ports with contiguous slots. */
 	ports = ch->ports;
@@ -386,35 +435,9 @@ hdspechan_enable(struct sc_chinfo *ch, int value)
 static int
 hdspe_running(struct sc_info *sc)
 {
-	struct sc_pcminfo *scp;
-	struct sc_chinfo *ch;
-	device_t *devlist;
-	int devcount;
-	int i, j;
-	int err;
-
-	if ((err = device_get_children(sc->dev, &devlist, &devcount)) != 0)
-		goto bad;
-
-	for (i = 0; i < devcount; i++) {
-		scp = device_get_ivars(devlist[i]);
-		for (j = 0; j < scp->chnum; j++) {
-			ch = &scp->chan[j];
-			if (ch->run)
-				goto bad;
-		}
-	}
-
-	free(devlist, M_TEMP);
-
-	return (0);
-bad:
-
-#if 1
-	device_printf(sc->dev, "hdspe is running\n");
-#endif
 
-	free(devlist, M_TEMP);
+	if (atomic_load_acq_32(&sc->running) == 0)
+		return (0);
 
 	return (1);
 }
@@ -423,6 +446,12 @@ static void
 hdspe_start_audio(struct sc_info *sc)
 {
 
+	/* Position restarts, don't count it as missed periods. */
+	if ((sc->ctrl_register & HDSPE_ENABLE) == 0) {
+		sc->period_pos_valid = false;
+		hdspe_dll_reset(sc);
+	}
+
 	sc->ctrl_register |= (HDSPE_AUDIO_INT_ENABLE | HDSPE_ENABLE);
 	hdspe_write_4(sc, HDSPE_CONTROL_REG, sc->ctrl_register);
 }
@@ -438,112 +467,279 @@ hdspe_stop_audio(struct sc_info *sc)
 	hdspe_write_4(sc, HDSPE_CONTROL_REG, sc->ctrl_register);
 }
 
-static void
-buffer_mux_write(uint32_t *dma, uint32_t *pcm, unsigned int pos,
-    unsigned int samples, unsigned int slots, unsigned int channels)
+/*
+ * Sample format conversions, kept in integer registers. Kernel code can't
+ * use the FPU / SIMD registers cheaply.
+ */
+
+#ifdef AFMT_F32_LE
+/*
+ * Convert between 32 bit samples and normalized IEEE 754 single precision
+ * floats on their bit patterns. Floats outside of [-1.0, 1.0] and NaN are
+ * clipped.
+ */
+static __inline uint32_t
+buffer_s32_to_f32(uint32_t sample)
 {
-	int slot;
+	uint32_t sign, mag;
+	int e;
 
-	for (; samples > 0; samples--) {
-		for (slot = 0; slot < slots; slot++) {
-			dma[slot * HDSPE_CHANBUF_SAMPLES + pos] =
-			    pcm[pos * channels + slot];
-		}
-		pos = (pos + 1) % HDSPE_CHANBUF_SAMPLES;
+	if (sample == 0)
+		return (0);
+
+	sign = sample & 0x80000000;
+	mag = sign ? -sample : sample;
+	e = fls(mag) - 1;
+	/* Only 24 significant bits, truncate the rest. */
+	if (e > 23)
+		mag >>= e - 23;
+	else
+		mag <<= 23 - e;
+
+	return (sign | (uint32_t)(e + 96) << 23 | (mag & 0x7fffff));
+}
+
+static __inline uint32_t
+buffer_f32_to_s32(uint32_t f)
+{
+	uint32_t mag;
+	int e;
+
+	e = (f >> 23) & 0xff;
+	if (e < 96)
+		return (0);
+	if (e >= 127)
+		return ((f & 0x80000000) ? 0x80000000 : 0x7fffffff);
+
+	mag = (f & 0x7fffff) | 0x800000;
+	if (e >= 119)
+		mag <<= e - 119;
+	else
+		mag >>= 119 - e;
+
+	return ((f & 0x80000000) ? -mag : mag);
+}
+#endif
+
+/*
+ * Widen a pcm sample to the 32 bit DMA sample format, MSB aligned. Constant
+ * formats let the compiler reduce this to a single load.
+ */
+static __inline uint32_t
+buffer_sample_load(const uint8_t *pcm, uint32_t fmt)
+{
+
+	if (fmt == AFMT_S16_LE)
+		return ((uint32_t)*(const uint16_t *)pcm << 16);
+	if (fmt == AFMT_S24_LE)
+		return ((uint32_t)pcm[0] << 8 | (uint32_t)pcm[1] << 16 |
+		    (uint32_t)pcm[2] << 24);
+#ifdef AFMT_F32_LE
+	if (fmt == AFMT_F32_LE)
+		return (buffer_f32_to_s32(*(const uint32_t *)pcm));
+#endif
+	return (*(const uint32_t *)pcm);
+}
+
+/* Narrow a 32 bit DMA sample to the pcm format, truncating low bits. */
+static __inline void
+buffer_sample_store(uint8_t *pcm, uint32_t sample, uint32_t fmt)
+{
+
+	if (fmt == AFMT_S16_LE) {
+		*(uint16_t *)pcm = sample >> 16;
+	} else if (fmt == AFMT_S24_LE) {
+		pcm[0] = sample >> 8;
+		pcm[1] = sample >> 16;
+		pcm[2] = sample >> 24;
+#ifdef AFMT_F32_LE
+	} else if (fmt == AFMT_F32_LE) {
+		*(uint32_t *)pcm = buffer_s32_to_f32(sample);
+#endif
+	} else {
+		*(uint32_t *)pcm = sample;
 	}
 }
 
-static void
-buffer_mux_port(uint32_t *dma, uint32_t *pcm, uint32_t subset, uint32_t ports,
-    unsigned int pos, unsigned int samples, unsigned int adat_width,
-    unsigned int pcm_width)
+static __inline void
+buffer_mux_write(uint32_t *dma, uint8_t *pcm, unsigned int samples,
+    unsigned int slots, unsigned int channels, uint32_t fmt)
 {
-	unsigned int slot_offset, slots;
-	unsigned int channels, chan_pos;
+	uint8_t *src;
+	uint32_t *dst;
+	unsigned int bps, frame, i;
+	int slot;
 
-	/* Translate DMA slot offset to DMA buffer offset. */
-	slot_offset = hdspe_port_slot_offset(subset, adat_width);
-	dma += slot_offset * HDSPE_CHANBUF_SAMPLES;
+	bps = AFMT_BPS(fmt);
+	frame = channels * bps;
 
-	/* Channel position of the port subset and total number of channels. */
-	chan_pos = hdspe_channel_offset(subset, ports, pcm_width);
-	pcm += chan_pos;
-	channels = hdspe_channel_count(ports, pcm_width);
+	/* Transpose blocks of frames, one store run per slot. */
+	for (i = 0; i + HDSPE_MUX_BLOCK <= samples; i += HDSPE_MUX_BLOCK) {
+		dst = dma + i;
+		src = pcm;
+		for (slot = 0; slot < slots; slot++) {
+			dst[0] = buffer_sample_load(src, fmt);
+			dst[1] = buffer_sample_load(src + frame, fmt);
+			dst[2] = buffer_sample_load(src + 2 * frame, fmt);
+			dst[3] = buffer_sample_load(src + 3 * frame, fmt);
+			dst += HDSPE_CHANBUF_SAMPLES;
+			src += bps;
+		}
+		pcm += HDSPE_MUX_BLOCK * frame;
+	}
 
-	/* Only copy as much as supported by both hardware and pcm channel. */
-	slots = hdspe_port_slot_width(subset, MIN(adat_width, pcm_width));
+	/* Remaining frames, if not a multiple of the block size. */
+	for (; i < samples; i++) {
+		for (slot = 0; slot < slots; slot++)
+			dma[slot * HDSPE_CHANBUF_SAMPLES + i] =
+			    buffer_sample_load(pcm + slot * bps, fmt);
+		pcm += frame;
+	}
+}
+
+static __inline void
+buffer_mux_slots(uint32_t *dma, uint8_t *pcm, unsigned int samples,
+    unsigned int slots, unsigned int channels, uint32_t fmt)
+{
 
-	/* Let the compiler inline and loop unroll common cases. */
 	if (slots == 2)
-		buffer_mux_write(dma, pcm, pos, samples, 2, channels);
+		buffer_mux_write(dma, pcm, samples, 2, channels, fmt);
 	else if (slots == 4)
-		buffer_mux_write(dma, pcm, pos, samples, 4, channels);
+		buffer_mux_write(dma, pcm, samples, 4, channels, fmt);
 	else if (slots == 8)
-		buffer_mux_write(dma, pcm, pos, samples, 8, channels);
+		buffer_mux_write(dma, pcm, samples, 8, channels, fmt);
 	else
-		buffer_mux_write(dma, pcm, pos, samples, slots, channels);
+		buffer_mux_write(dma, pcm, samples, slots, channels, fmt);
 }
 
 static void
-buffer_demux_read(uint32_t *dma, uint32_t *pcm, unsigned int pos,
-    unsigned int samples, unsigned int slots, unsigned int channels)
+buffer_mux_port(uint32_t *dma, uint8_t *pcm, struct hdspe_copy_seg *seg,
+    unsigned int pos, unsigned int samples, unsigned int channels,
+    uint32_t fmt)
 {
+
+	SDT_PROBE4(hdspe, , buffer, mux, seg->slot, seg->chan, pos,
+	    samples);
+
+	/* Translate DMA slot offset and position to DMA buffer offset. */
+	dma += seg->slot * HDSPE_CHANBUF_SAMPLES + pos;
+	/* Channel position of the port subset at the same position. */
+	pcm += (pos * channels + seg->chan) * AFMT_BPS(fmt);
+
+	/* Let the compiler inline and loop unroll common cases. */
+	if (fmt == AFMT_S16_LE)
+		buffer_mux_slots(dma, pcm, samples, seg->slots, channels,
+		    AFMT_S16_LE);
+	else if (fmt == AFMT_S24_LE)
+		buffer_mux_slots(dma, pcm, samples, seg->slots, channels,
+		    AFMT_S24_LE);
+#ifdef AFMT_F32_LE
+	else if (fmt == AFMT_F32_LE)
+		buffer_mux_slots(dma, pcm, samples, seg->slots, channels,
+		    AFMT_F32_LE);
+#endif
+	else
+		buffer_mux_slots(dma, pcm, samples, seg->slots, channels,
+		    AFMT_S32_LE);
+}
+
+static __inline void
+buffer_demux_read(uint32_t *dma, uint8_t *pcm, unsigned int samples,
+    unsigned int slots, unsigned int channels, uint32_t fmt)
+{
+	uint32_t *src;
+	uint8_t *dst;
+	unsigned int bps, frame, i;
 	int slot;
 
-	for (; samples > 0; samples--) {
+	bps = AFMT_BPS(fmt);
+	frame = channels * bps;
+
+	/* Transpose blocks of frames, one load run per slot. */
+	for (i = 0; i + HDSPE_MUX_BLOCK <= samples; i += HDSPE_MUX_BLOCK) {
+		src = dma + i;
+		dst = pcm;
 		for (slot = 0; slot < slots; slot++) {
-			pcm[pos * channels + slot] =
-			    dma[slot * HDSPE_CHANBUF_SAMPLES + pos];
+			buffer_sample_store(dst, src[0], fmt);
+			buffer_sample_store(dst + frame, src[1], fmt);
+			buffer_sample_store(dst + 2 * frame, src[2], fmt);
+			buffer_sample_store(dst + 3 * frame, src[3], fmt);
+			src += HDSPE_CHANBUF_SAMPLES;
+			dst += bps;
 		}
-		pos = (pos + 1) % HDSPE_CHANBUF_SAMPLES;
+		pcm += HDSPE_MUX_BLOCK * frame;
+	}
+
+	/* Remaining frames, if not a multiple of the block size. */
+	for (; i < samples; i++) {
+		for (slot = 0; slot < slots; slot++)
+			buffer_sample_store(pcm + slot * bps,
+			    dma[slot * HDSPE_CHANBUF_SAMPLES + i], fmt);
+		pcm += frame;
 	}
 }
 
-static void
-buffer_demux_port(uint32_t *dma, uint32_t *pcm, uint32_t subset, uint32_t ports,
-    unsigned int pos, unsigned int samples, unsigned int adat_width,
-    unsigned int pcm_width)
+static __inline void
+buffer_demux_slots(uint32_t *dma, uint8_t *pcm, unsigned int samples,
+    unsigned int slots, unsigned int channels, uint32_t fmt)
 {
-	unsigned int slot_offset, slots;
-	unsigned int channels, chan_pos;
-
-	/* Translate port slot offset to DMA buffer offset. */
-	slot_offset = hdspe_port_slot_offset(subset, adat_width);
-	dma += slot_offset * HDSPE_CHANBUF_SAMPLES;
-
-	/* Channel position of the port subset and total number of channels. */
-	chan_pos = hdspe_channel_offset(subset, ports, pcm_width);
-	pcm += chan_pos;
-	channels = hdspe_channel_count(ports, pcm_width);
-
-	/* Only copy as much as supported by both hardware and pcm channel. */
-	slots = hdspe_port_slot_width(subset, MIN(adat_width, pcm_width));
 
-	/* Let the compiler inline and loop unroll common cases. */
 	if (slots == 2)
-		buffer_demux_read(dma, pcm, pos, samples, 2, channels);
+		buffer_demux_read(dma, pcm, samples, 2, channels, fmt);
 	else if (slots == 4)
-		buffer_demux_read(dma, pcm, pos, samples, 4, channels);
+		buffer_demux_read(dma, pcm, samples, 4, channels, fmt);
 	else if (slots == 8)
-		buffer_demux_read(dma, pcm, pos, samples, 8, channels);
+		buffer_demux_read(dma, pcm, samples, 8, channels, fmt);
 	else
-		buffer_demux_read(dma, pcm, pos, samples, slots, channels);
+		buffer_demux_read(dma, pcm, samples, slots, channels, fmt);
 }
 
+static void
+buffer_demux_port(uint32_t *dma, uint8_t *pcm, struct hdspe_copy_seg *seg,
+    unsigned int pos, unsigned int samples, unsigned int channels,
+    uint32_t fmt)
+{
+
+	SDT_PROBE4(hdspe, , buffer, demux, seg->slot, seg->chan, pos,
+	    samples);
 
-/* Copy data between DMA and PCM buffers. */
+	/* Translate DMA slot offset and position to DMA buffer offset. */
+	dma += seg->slot * HDSPE_CHANBUF_SAMPLES + pos;
+	/* Channel position of the port subset at the same position. */
+	pcm += (pos * channels + seg->chan) * AFMT_BPS(fmt);
+
+	/* Let the compiler inline and loop unroll common cases. */
+	if (fmt == AFMT_S16_LE)
+		buffer_demux_slots(dma, pcm, samples, seg->slots, channels,
+		    AFMT_S16_LE);
+	else if (fmt == AFMT_S24_LE)
+		buffer_demux_slots(dma, pcm, samples, seg->slots, channels,
+		    AFMT_S24_LE);
+#ifdef AFMT_F32_LE
+	else if (fmt == AFMT_F32_LE)
+		buffer_demux_slots(dma, pcm, samples, seg->slots, channels,
+		    AFMT_F32_LE);
+#endif
+	else
+		buffer_demux_slots(dma, pcm, samples, seg->slots, channels,
+		    AFMT_S32_LE);
+}
+
+/*
+ * Compile the copy plan of a channel, a list of contiguous slot runs and
+ * their pcm channel position. Depends on pcm format and sample rate, has to
+ * be updated whenever one of those changes.
+ */
 static void
-buffer_copy(struct sc_chinfo *ch)
+buffer_plan(struct sc_chinfo *ch)
 {
-	struct sc_pcminfo *scp;
+	struct hdspe_copy_seg *seg;
 	struct sc_info *sc;
 	uint32_t row, ports;
-	unsigned int pos;
 	unsigned int n;
 	unsigned int adat_width, pcm_width;
 
-	scp = ch->parent;
-	sc = scp->sc;
+	sc = ch->parent->sc;
 
 	n = AFMT_CHANNEL(ch->format); /* n channels */
 
@@ -556,30 +752,24 @@ buffer_copy(struct sc_chinfo *ch)
 	else
 		pcm_width = 8;
 
-	if (ch->dir == PCMDIR_PLAY) {
-		pos = sndbuf_getreadyptr(ch->buffer);
-	} else {
-		pos = sndbuf_getfreeptr(ch->buffer);
-	}
-
-	pos /= 4; /* Bytes per sample. */
-	pos /= n; /* Destination buffer n-times smaller. */
+	/* Total number of pcm channels, interleaved. */
+	ch->channels = hdspe_channel_count(ch->ports, pcm_width);
 
 	/* Iterate through rows of ports with contiguous slots. */
+	ch->nsegs = 0;
 	ports = ch->ports;
 	if (pcm_width == adat_width)
 		row = hdspe_port_first_row(ports);
 	else
 		row = hdspe_port_first(ports);
 
-	while (row != 0) {
-		if (ch->dir == PCMDIR_PLAY) {
-			buffer_mux_port(sc->pbuf, ch->data, row, ch->ports, pos,
-			    sc->period * 2, adat_width, pcm_width);
-		} else {
-			buffer_demux_port(sc->rbuf, ch->data, row, ch->ports,
-			    pos, sc->period * 2, adat_width, pcm_width);
-		}
+	while (row != 0 && ch->nsegs < HDSPE_MAX_SEGS) {
+		seg = &ch->segs[ch->nsegs++];
+		seg->slot = hdspe_port_slot_offset(row, adat_width);
+		seg->chan = hdspe_channel_offset(row, ch->ports, pcm_width);
+		/* Only copy as much as supported by hardware and pcm channel. */
+		seg->slots =
+		    hdspe_port_slot_width(row, MIN(adat_width, pcm_width));
 
 		ports &= ~row;
 		if (pcm_width == adat_width)
@@ -589,6 +779,131 @@ buffer_copy(struct sc_chinfo *ch)
 	}
 }
 
+/* Count an overrun or underrun and notify devd if requested. */
+static void
+hdspe_xrun(struct sc_chinfo *ch)
+{
+	struct sc_pcminfo *scp;
+	struct sc_info *sc;
+	char buf[32];
+
+	scp = ch->parent;
+	sc = scp->sc;
+
+	if (ch->dir == PCMDIR_PLAY)
+		scp->play_xruns++;
+	else
+		scp->rec_xruns++;
+	sc->xruns++;
+
+	if (sc->xrun_events) {
+		snprintf(buf, sizeof(buf), "pcm=%u dir=%s", scp->index,
+		    ch->dir == PCMDIR_PLAY ? "play" : "rec");
+		devctl_notify("HDSPE", device_get_nameunit(sc->dev), "XRUN",
+		    buf);
+	}
+}
+
+/* Copy data between DMA and PCM buffers. */
+static void
+buffer_copy(struct sc_chinfo *ch)
+{
+	struct sc_pcminfo *scp;
+	struct sc_info *sc;
+	unsigned int pos, done, end, ready, free;
+	unsigned int samples, n;
+	unsigned int i;
+	uint64_t start, cycles;
+
+	scp = ch->parent;
+	sc = scp->sc;
+
+	counter_u64_add(sc->st_copies, 1);
+
+	if (ch->dir == PCMDIR_PLAY) {
+		pos = sndbuf_getreadyptr(ch->buffer);
+		ready = sndbuf_getready(ch->buffer);
+		free = 0;
+	} else {
+		pos = sndbuf_getfreeptr(ch->buffer);
+		ready = 0;
+		free = sndbuf_getfree(ch->buffer);
+	}
+
+	pos /= AFMT_BPS(ch->format); /* Bytes per sample. */
+	pos /= AFMT_CHANNEL(ch->format); /* Destination buffer n-times smaller. */
+	ready /= AFMT_BPS(ch->format) * AFMT_CHANNEL(ch->format);
+	free /= AFMT_BPS(ch->format) * AFMT_CHANNEL(ch->format);
+
+	/* Skip samples already copied since the last interrupt. */
+	done = 0;
+	if (ch->copy_valid) {
+		done = (ch->copied + HDSPE_CHANBUF_SAMPLES - pos) %
+		    HDSPE_CHANBUF_SAMPLES;
+		/* Hardware overtook the copied samples, start over. */
+		if (done >= HDSPE_CHANBUF_SAMPLES / 2)
+			done = 0;
+	}
+
+	if (ch->dir == PCMDIR_PLAY) {
+		/* Hardware played past the copied samples at the interrupt. */
+		if (ch->copy_valid && (ch->copied + HDSPE_CHANBUF_SAMPLES -
+		    sc->period_pos) % HDSPE_CHANBUF_SAMPLES >=
+		    HDSPE_CHANBUF_SAMPLES / 2)
+			hdspe_xrun(ch);
+		/* Fill the current and lookahead periods ahead of hardware. */
+		end = MIN(sc->period * (1 + sc->lookahead),
+		    HDSPE_CHANBUF_SAMPLES / 2);
+		/* Samples not ready yet have to be copied again next time. */
+		ch->copied = (pos + MAX(done, MIN(end, ready))) %
+		    HDSPE_CHANBUF_SAMPLES;
+	} else {
+		/* Fetch everything recorded by the hardware so far. */
+		end = (hdspe_hw_position(sc) + HDSPE_CHANBUF_SAMPLES - pos) %
+		    HDSPE_CHANBUF_SAMPLES;
+		/* Recorded more than the pcm buffer can take. */
+		if (ch->copy_valid && end > free)
+			hdspe_xrun(ch);
+		ch->copied = (pos + MAX(done, end)) % HDSPE_CHANBUF_SAMPLES;
+	}
+	ch->copy_valid = 1;
+
+	if (end <= done)
+		return;
+
+	start = get_cyclecount();
+	pos = (pos + done) % HDSPE_CHANBUF_SAMPLES;
+	samples = end - done;
+	counter_u64_add(ch->dir == PCMDIR_PLAY ? sc->st_play_bytes :
+	    sc->st_rec_bytes, samples * 4 * ch->channels);
+	while (samples > 0) {
+		/* Split at the end of the ring buffer, no wraparound in loops. */
+		n = MIN(samples, HDSPE_CHANBUF_SAMPLES - pos);
+
+		/* Walk the precompiled copy plan. */
+		for (i = 0; i < ch->nsegs; i++) {
+			if (ch->dir == PCMDIR_PLAY) {
+				buffer_mux_port(sc->pbuf, ch->data,
+				    &ch->segs[i], pos, n, ch->channels,
+				    AFMT_ENCODING(ch->format));
+			} else {
+				buffer_demux_port(sc->rbuf, ch->data,
+				    &ch->segs[i], pos, n, ch->channels,
+				    AFMT_ENCODING(ch->format));
+			}
+		}
+
+		samples -= n;
+		pos = (pos + n) % HDSPE_CHANBUF_SAMPLES;
+	}
+
+	cycles = get_cyclecount() - start;
+	hdspe_hist_add(&scp->hist_copy, cycles);
+	counter_u64_add(sc->st_copy_cycles, cycles);
+	sc->intr_copy_cycles += cycles;
+	sc->copy_cycles_max = MAX(sc->copy_cycles_max, cycles);
+}
+
 static int
 clean(struct sc_chinfo *ch)
 {
@@ -606,6 +921,9 @@ clean(struct sc_chinfo *ch)
 		buf = sc->pbuf;
 	}
 
+	/* DMA buffers not allocated or already released. */
+	if (buf == NULL)
+		return (0);
 
 	/* Iterate through rows of ports with contiguous slots. */
 	ports = ch->ports;
@@ -633,7 +951,8 @@ hdspechan_init(kobj_t obj, void *devinfo, struct snd_dbuf *b,
 	struct sc_pcminfo *scp;
 	struct sc_chinfo *ch;
 	struct sc_info *sc;
-	int num;
+	unsigned int adat_width, n;
+	int i, num;
 
 	scp = devinfo;
 	sc = scp->sc;
@@ -652,16 +971,19 @@ hdspechan_init(kobj_t obj, void *devinfo, struct snd_dbuf *b,
 		ch->ports = hdspe_channel_rec_ports(scp->hc);
 
 	ch->run = 0;
+	ch->runbit = HDSPE_RUN_BIT(scp->index, num);
 	ch->lvol = 0;
 	ch->rvol = 0;
 
-	ch->cap_fmts[0] =
-	    SND_FORMAT(AFMT_S32_LE, hdspe_channel_count(ch->ports, 2), 0);
-	ch->cap_fmts[1] =
-	    SND_FORMAT(AFMT_S32_LE, hdspe_channel_count(ch->ports, 4), 0);
-	ch->cap_fmts[2] =
-	    SND_FORMAT(AFMT_S32_LE, hdspe_channel_count(ch->ports, 8), 0);
-	ch->cap_fmts[3] = 0;
+	/* Each sample format in every ADAT width. */
+	n = 0;
+	for (i = 0; hdspe_encodings[i] != 0; i++) {
+		for (adat_width = 2; adat_width <= 8; adat_width *= 2) {
+			ch->cap_fmts[n++] = SND_FORMAT(hdspe_encodings[i],
+			    hdspe_channel_count(ch->ports, adat_width), 0);
+		}
+	}
+	ch->cap_fmts[n] = 0;
 	ch->caps = malloc(sizeof(struct pcmchan_caps), M_HDSPE, M_NOWAIT);
 	*(ch->caps) = (struct pcmchan_caps) {32000, 192000, ch->cap_fmts, 0};
 
@@ -691,17 +1013,29 @@ hdspechan_trigger(kobj_t obj, void *data, int go)
 	struct sc_pcminfo *scp;
 	struct sc_chinfo *ch;
 	struct sc_info *sc;
+	int err;
 
 	ch = data;
 	scp = ch->parent;
 	sc = scp->sc;
 
+	err = 0;
+
 	snd_mtxlock(sc->lock);
 	switch (go) {
 	case PCMTRIG_START:
-#if 1
-		device_printf(scp->dev, "hdspechan_trigger(): start\n");
-#endif
+		/* Raw device node has exclusive access while open or mapped. */
+		if (sc->raw_open || sc->raw_mapped != 0) {
+			err = EBUSY;
+			break;
+		}
+		/* Can't sleep here, fails with ENOMEM if memory is short. */
+		err = hdspe_dma_start(sc);
+		if (err != 0)
+			break;
+		SDT_PROBE2(hdspe, , chan, trigger, ch, go);
+		buffer_plan(ch);
+		ch->copy_valid = 0;
 		hdspechan_enable(ch, 1);
 		hdspechan_setgain(ch);
 		hdspe_start_audio(sc);
@@ -709,12 +1043,11 @@ hdspechan_trigger(kobj_t obj, void *data, int go)
 
 	case PCMTRIG_STOP:
 	case PCMTRIG_ABORT:
-#if 1
-		device_printf(scp->dev, "hdspechan_trigger(): stop or abort\n");
-#endif
+		SDT_PROBE2(hdspe, , chan, trigger, ch, go);
 		clean(ch);
 		hdspechan_enable(ch, 0);
 		hdspe_stop_audio(sc);
+		hdspe_dma_idle(sc);
 		break;
 
 	case PCMTRIG_EMLDMAWR:
@@ -724,9 +1057,51 @@ hdspechan_trigger(kobj_t obj, void *data, int go)
 		break;
 	}
 
+	/* Running channels changed, also when idle afterwards. */
+	if (go == PCMTRIG_START || go == PCMTRIG_STOP || go == PCMTRIG_ABORT)
+		hdspe_status_update(sc, hdspe_read_4(sc, HDSPE_STATUS1_REG));
 	snd_mtxunlock(sc->lock);
 
-	return (0);
+	return (err);
+}
+
+/* Interpolated hardware position between period interrupts. */
+static int
+hdspe_dll_position(struct sc_info *sc, uint32_t *pos)
+{
+	struct hdspe_dll *dll;
+	uint64_t t0, t1, now;
+	uint32_t pos0, period, offset;
+	seqc_t seqc;
+	bool valid;
+
+	dll = &sc->dll;
+
+	for (;;) {
+		seqc = seqc_read(&dll->seqc);
+		valid = dll->valid;
+		t0 = dll->t0;
+		t1 = dll->t1;
+		pos0 = dll->pos0;
+		period = dll->period;
+		if (seqc_consistent(&dll->seqc, seqc))
+			break;
+	}
+
+	if (!valid || t1 <= t0)
+		return (0);
+
+	/* Never run ahead of the next period interrupt. */
+	now = get_cyclecount();
+	offset = 0;
+	if (now >= t1)
+		offset = period;
+	else if (now > t0)
+		offset = (now - t0) * period / (t1 - t0);
+
+	*pos = (pos0 + offset) % HDSPE_CHANBUF_SAMPLES;
+
+	return (1);
 }
 
 static uint32_t
@@ -735,17 +1110,19 @@ hdspechan_getptr(kobj_t obj, void *data)
 	struct sc_pcminfo *scp;
 	struct sc_chinfo *ch;
 	struct sc_info *sc;
-	uint32_t ret, pos;
+	uint32_t pos;
 
 	ch = data;
 	scp = ch->parent;
 	sc = scp->sc;
 
-	snd_mtxlock(sc->lock);
-	ret = hdspe_read_2(sc, HDSPE_STATUS_REG);
-	snd_mtxunlock(sc->lock);
+	/* Recorded samples are only available once copied. */
+	if (ch->dir == PCMDIR_REC && ch->copy_valid)
+		pos = ch->copied;
+	else if (hdspe_dll_position(sc, &pos) == 0)
+		pos = hdspe_hw_position(sc);
 
-	pos = ret & HDSPE_BUF_POSITION_MASK;
+	pos *= AFMT_BPS(ch->format); /* Bytes per sample. */
 	pos *= AFMT_CHANNEL(ch->format); /* Hardbuf with multiple channels. */
 
 	return (pos);
@@ -762,9 +1139,7 @@ hdspechan_free(kobj_t obj, void *data)
 	scp = ch->parent;
 	sc = scp->sc;
 
-#if 1
-	device_printf(scp->dev, "hdspechan_free()\n");
-#endif
+	SDT_PROBE1(hdspe, , chan, free, ch);
 
 	snd_mtxlock(sc->lock);
 	if (ch->data != NULL) {
@@ -787,12 +1162,12 @@ hdspechan_setformat(kobj_t obj, void *data, uint32_t format)
 
 	ch = data;
 
-#if 1
-	struct sc_pcminfo *scp = ch->parent;
-	device_printf(scp->dev, "hdspechan_setformat(%d)\n", format);
-#endif
+	SDT_PROBE2(hdspe, , chan, setformat, ch, format);
 
+	snd_mtxlock(ch->parent->sc->lock);
 	ch->format = format;
+	buffer_plan(ch);
+	snd_mtxunlock(ch->parent->sc->lock);
 
 	return (0);
 }
@@ -805,6 +1180,7 @@ hdspechan_setspeed(kobj_t obj, void *data, uint32_t speed)
 	struct sc_chinfo *ch;
 	struct sc_info *sc;
 	long long period;
+	uint32_t requested;
 	int threshold;
 	int i;
 
@@ -812,10 +1188,7 @@ hdspechan_setspeed(kobj_t obj, void *data, uint32_t speed)
 	scp = ch->parent;
 	sc = scp->sc;
 	hr = NULL;
-
-#if 1
-	device_printf(scp->dev, "hdspechan_setspeed(%d)\n", speed);
-#endif
+	requested = speed;
 
 	if (hdspe_running(sc) == 1)
 		goto end;
@@ -865,8 +1238,13 @@ hdspechan_setspeed(kobj_t obj, void *data, uint32_t speed)
 	period /= speed;
 	hdspe_write_4(sc, HDSPE_FREQ_REG, period);
 
+	snd_mtxlock(sc->lock);
 	sc->speed = hr->speed;
+	buffer_plan(ch);
+	hdspe_status_update(sc, hdspe_read_4(sc, HDSPE_STATUS1_REG));
+	snd_mtxunlock(sc->lock);
 end:
+	SDT_PROBE3(hdspe, , chan, setspeed, ch, requested, sc->speed);
 
 	return (sc->speed);
 }
@@ -878,6 +1256,7 @@ hdspechan_setblocksize(kobj_t obj, void *data, uint32_t blocksize)
 	struct sc_pcminfo *scp;
 	struct sc_chinfo *ch;
 	struct sc_info *sc;
+	uint32_t requested;
 	int threshold;
 	int i;
 
@@ -885,20 +1264,17 @@ hdspechan_setblocksize(kobj_t obj, void *data, uint32_t blocksize)
 	scp = ch->parent;
 	sc = scp->sc;
 	hl = NULL;
-
-#if 1
-	device_printf(scp->dev, "hdspechan_setblocksize(%d)\n", blocksize);
-#endif
+	requested = blocksize;
 
 	if (hdspe_running(sc) == 1)
 		goto end;
 
-	if (blocksize > HDSPE_LAT_BYTES_MAX)
-		blocksize = HDSPE_LAT_BYTES_MAX;
-	else if (blocksize < HDSPE_LAT_BYTES_MIN)
-		blocksize = HDSPE_LAT_BYTES_MIN;
+	blocksize /= AFMT_BPS(ch->format) /* samples */;
 
-	blocksize /= 4 /* samples */;
+	if (blocksize > HDSPE_LAT_SAMPLES_MAX)
+		blocksize = HDSPE_LAT_SAMPLES_MAX;
+	else if (blocksize < HDSPE_LAT_SAMPLES_MIN)
+		blocksize = HDSPE_LAT_SAMPLES_MIN;
 
 	/* Enforce blocksize to be the same for playback and recording! */
 	if (sc->force_period > 0)
@@ -927,16 +1303,15 @@ hdspechan_setblocksize(kobj_t obj, void *data, uint32_t blocksize)
 	sc->ctrl_register |= hdspe_encode_latency(hl->n);
 	hdspe_write_4(sc, HDSPE_CONTROL_REG, sc->ctrl_register);
 	sc->period = hl->period;
+	hdspe_status_update(sc, hdspe_read_4(sc, HDSPE_STATUS1_REG));
 	snd_mtxunlock(sc->lock);
 
-#if 1
-	device_printf(scp->dev, "New period=%d\n", sc->period);
-#endif
-
 	sndbuf_resize(ch->buffer,
-	    (HDSPE_CHANBUF_SIZE * AFMT_CHANNEL(ch->format)) / (sc->period * 4),
-	    (sc->period * 4));
+	    (HDSPE_CHANBUF_SAMPLES * AFMT_CHANNEL(ch->format)) / sc->period,
+	    sc->period * AFMT_BPS(ch->format));
 end:
+	SDT_PROBE4(hdspe, , chan, setblocksize, ch, requested, sc->period,
+	    sndbuf_getblksz(ch->buffer));
 
 	return (sndbuf_getblksz(ch->buffer));
 }
@@ -951,18 +1326,16 @@ static struct pcmchan_caps hdspe_bkp_caps = {32000, 192000, hdspe_bkp_fmt, 0};
 static struct pcmchan_caps *
 hdspechan_getcaps(kobj_t obj, void *data)
 {
+	struct sc_pcminfo *scp;
 	struct sc_chinfo *ch;
 	struct sc_info *sc;
 	unsigned int adat_width;
 	uint32_t format;
+	int i;
 
 	ch = data;
-	sc = ch->parent->sc;
-
-#if 1
-	struct sc_pcminfo *scp = ch->parent;
-	device_printf(scp->dev, "hdspechan_getcaps()\n");
-#endif
+	scp = ch->parent;
+	sc = scp->sc;
 
 	/*
 	 * Format selection with more than 8 channels is broken, always selects
@@ -974,15 +1347,17 @@ hdspechan_getcaps(kobj_t obj, void *data)
 		    hdspe_channel_count(ch->ports, adat_width), 0);
 
 		/* Swap capability formats if forced speed is not first. */
-		if (ch->cap_fmts[1] == format) {
-			ch->cap_fmts[1] = ch->cap_fmts[0];
-			ch->cap_fmts[0] = format;
-		} else if (ch->cap_fmts[2] == format) {
-			ch->cap_fmts[2] = ch->cap_fmts[0];
-			ch->cap_fmts[0] = format;
+		for (i = 1; ch->cap_fmts[i] != 0; i++) {
+			if (ch->cap_fmts[i] == format) {
+				ch->cap_fmts[i] = ch->cap_fmts[0];
+				ch->cap_fmts[0] = format;
+				break;
+			}
 		}
 	}
 
+	SDT_PROBE2(hdspe, , chan, getcaps, ch, ch->cap_fmts[0]);
+
 	if (ch->caps != NULL)
 		return (ch->caps);
 
@@ -1007,10 +1382,6 @@ static int
 hdspe_pcm_probe(device_t dev)
 {
 
-#if 1
-	device_printf(dev,"hdspe_pcm_probe()\n");
-#endif
-
 	return (0);
 }
 
@@ -1019,17 +1390,30 @@ hdspe_pcm_intr(struct sc_pcminfo *scp)
 {
 	struct sc_chinfo *ch;
 	struct sc_info *sc;
-	int i;
+	int i, done;
 
 	sc = scp->sc;
+	done = 0;
 
 	for (i = 0; i < scp->chnum; i++) {
 		ch = &scp->chan[i];
+		if (ch->run == 0)
+			continue;
+		SDT_PROBE3(hdspe, , pcm_intr, chan, scp, ch, ch->dir);
+		/* Lock hold time accounting, see hdspe_intr(). */
+		sc->lock_cycles += get_cyclecount() - sc->lock_stamp;
 		snd_mtxunlock(sc->lock);
 		chn_intr(ch->channel);
 		snd_mtxlock(sc->lock);
+		sc->lock_stamp = get_cyclecount();
+		done = 1;
 	}
 
+	/* Time from the interrupt until all channels are serviced. */
+	if (done)
+		hdspe_hist_add(&scp->hist_done,
+		    get_cyclecount() - sc->period_stamp);
+
 	return (0);
 }
 
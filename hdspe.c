@@ -32,7 +32,28 @@
  */
 
 #include <sys/types.h>
+#include <sys/conf.h>
+#include <sys/counter.h>
+#include <sys/kthread.h>
+#include <sys/priority.h>
+#include <sys/proc.h>
+#include <sys/rwlock.h>
+#include <sys/sched.h>
+#include <sys/sdt.h>
+#include <sys/seqc.h>
+#include <sys/smp.h>
 #include <sys/sysctl.h>
+#include <sys/taskqueue.h>
+
+#include <vm/vm.h>
+#include <vm/pmap.h>
+#include <vm/vm_extern.h>
+#include <vm/vm_kern.h>
+#include <vm/vm_object.h>
+#include <vm/vm_page.h>
+#include <vm/vm_pager.h>
+
+#include <machine/cpu.h>
 
 #include <dev/sound/pcm/sound.h>
 #include <hdspe.h>
@@ -43,6 +64,13 @@
 
 #include <mixer_if.h>
 
+#include <hdspe_ioctl.h>
+
+SDT_PROVIDER_DEFINE(hdspe);
+SDT_PROBE_DEFINE3(hdspe, , intr, entry, "struct sc_info *", "uint32_t",
+    "uint32_t");
+SDT_PROBE_DEFINE2(hdspe, , intr, return, "struct sc_info *", "uint64_t");
+
 static bool hdspe_unified_pcm = false;
 
 static SYSCTL_NODE(_hw, OID_AUTO, hdspe, CTLFLAG_RW | CTLFLAG_MPSAFE, 0,
@@ -51,6 +79,16 @@ static SYSCTL_NODE(_hw, OID_AUTO, hdspe, CTLFLAG_RW | CTLFLAG_MPSAFE, 0,
 SYSCTL_BOOL(_hw_hdspe, OID_AUTO, unified_pcm, CTLFLAG_RWTUN,
     &hdspe_unified_pcm, 0, "Combine physical ports in one unified pcm device");
 
+static int hdspe_msi = 1;
+
+SYSCTL_INT(_hw_hdspe, OID_AUTO, msi, CTLFLAG_RDTUN, &hdspe_msi, 0,
+    "Interrupt type: 0 = legacy INTx, 1 = MSI if available, 2 = MSI only");
+
+static int hdspe_intr_priority = PI_AV;
+
+SYSCTL_INT(_hw_hdspe, OID_AUTO, intr_priority, CTLFLAG_RDTUN,
+    &hdspe_intr_priority, 0, "Default priority of the interrupt copy threads");
+
 static struct hdspe_clock_source hdspe_clock_source_table_rd[] = {
 	{ "internal", 0 << 1 | 1, HDSPE_STATUS1_CLOCK(15),       0,       0 },
 	{ "word",     0 << 1 | 0, HDSPE_STATUS1_CLOCK( 0), 1 << 24, 1 << 25 },
@@ -105,50 +143,362 @@ static struct hdspe_channel chan_map_rd_uni[] = {
 	{ 0,                   NULL },
 };
 
-static void
-hdspe_intr(void *p)
+CTASSERT(HDSPE_MMAP_REC_OFFSET >= HDSPE_DMASEGSIZE);
+CTASSERT(HDSPE_MAX_PCM * 2 <= 32);
+
+static d_open_t		hdspe_raw_open;
+static d_close_t	hdspe_raw_close;
+static d_ioctl_t	hdspe_raw_ioctl;
+static d_mmap_single_t	hdspe_raw_mmap_single;
+
+static d_mmap_single_t hdspe_status_mmap_single;
+
+static struct cdevsw hdspe_status_cdevsw = {
+	.d_version =	D_VERSION,
+	.d_mmap_single =	hdspe_status_mmap_single,
+	.d_name =	"hdspe_status",
+};
+
+static struct cdevsw hdspe_cdevsw = {
+	.d_version =	D_VERSION,
+	.d_open =	hdspe_raw_open,
+	.d_close =	hdspe_raw_close,
+	.d_ioctl =	hdspe_raw_ioctl,
+	.d_mmap_single =	hdspe_raw_mmap_single,
+	.d_name =	"hdspe",
+};
+
+static int
+hdspe_filter(void *p)
 {
-	struct sc_pcminfo *scp;
 	struct sc_info *sc;
-	device_t *devlist;
-	int devcount;
 	int status;
-	int err;
-	int i;
 
 	sc = (struct sc_info *)p;
 
-	snd_mtxlock(sc->lock);
+	/* MSI vector is exclusive, only check the status on shared INTx. */
+	if (!sc->msi) {
+		status = hdspe_read_1(sc, HDSPE_STATUS_REG);
+		if ((status & HDSPE_AUDIO_IRQ_PENDING) == 0) {
+			counter_u64_add(sc->st_stray, 1);
+			return (FILTER_STRAY);
+		}
+	}
+
+	hdspe_write_1(sc, HDSPE_INTERRUPT_ACK, 0);
+	counter_u64_add(sc->st_intr, 1);
+
+	/* Hand the period over to the copy thread. */
+	mtx_lock_spin(&sc->intr_mtx);
+	sc->intr_stamp = get_cyclecount();
+	sc->intr_pos = hdspe_hw_position(sc);
+	sc->intr_pending++;
+	wakeup_one(&sc->intr_pending);
+	mtx_unlock_spin(&sc->intr_mtx);
+
+	return (FILTER_HANDLED);
+}
+
+/* Publish the status page for lockless readers, with the card lock held. */
+void
+hdspe_status_update(struct sc_info *sc, uint32_t status1)
+{
+	struct hdspe_status *st;
+
+	st = sc->status;
+
+	seqc_write_begin(&st->seq);
+	st->position = sc->period_pos;
+	st->period_count = sc->period_count;
+	st->timestamp = sc->period_time;
+	st->status1 = status1;
+	st->speed = sc->speed;
+	st->period = sc->period;
+	st->running = sc->running;
+	seqc_write_end(&st->seq);
+}
+
+/* Invalidate the loop when audio starts, with the card lock held. */
+void
+hdspe_dll_reset(struct sc_info *sc)
+{
+	struct hdspe_dll *dll;
+
+	dll = &sc->dll;
 
-	status = hdspe_read_1(sc, HDSPE_STATUS_REG);
-	if (status & HDSPE_AUDIO_IRQ_PENDING) {
-		if ((err = device_get_children(sc->dev, &devlist, &devcount)) != 0)
-			return;
+	seqc_write_begin(&dll->seqc);
+	dll->valid = false;
+	dll->state = 0;
+	seqc_write_end(&dll->seqc);
+}
+
+static void
+hdspe_dll_update(struct sc_info *sc, uint64_t stamp, uint32_t pos,
+    bool restart)
+{
+	struct hdspe_dll *dll;
+	uint64_t omega;
+	int64_t e;
 
-		for (i = 0; i < devcount; i++) {
-			scp = device_get_ivars(devlist[i]);
-			if (scp->ih != NULL)
-				scp->ih(scp);
+	dll = &sc->dll;
+
+	seqc_write_begin(&dll->seqc);
+
+	/* Discontinuity or new configuration, measure a period again. */
+	if (restart || sc->period == 0 || dll->period != sc->period ||
+	    dll->speed != sc->speed) {
+		dll->period = sc->period;
+		dll->speed = sc->speed;
+		dll->state = 0;
+	}
+
+	/* Interrupts are close to period boundaries. */
+	if (dll->period > 0)
+		pos = rounddown(pos + dll->period / 2, dll->period) %
+		    HDSPE_CHANBUF_SAMPLES;
+
+	switch (dll->state) {
+	case 0:
+		dll->valid = false;
+		dll->state = 1;
+		break;
+	case 1:
+		/*
+		 * Start from the measured period, loop bandwidth B:
+		 * omega = 2 pi B period / speed, b = sqrt(2) omega,
+		 * c = omega^2.
+		 */
+		omega = HDSPE_DLL_2PI_Q32 * HDSPE_DLL_BANDWIDTH *
+		    dll->period / dll->speed;
+		omega = MIN(omega, (1ULL << 32) / 8);
+		dll->b = (omega * HDSPE_DLL_SQRT2_Q16) >> 16;
+		dll->c = (omega * omega) >> 32;
+		dll->e2 = (stamp - dll->last) << 16;
+		dll->t0 = stamp;
+		dll->t1 = stamp + (stamp - dll->last);
+		dll->pos0 = pos;
+		dll->valid = true;
+		dll->state = 2;
+		break;
+	default:
+		e = (int64_t)(stamp - dll->t1);
+		if ((uint64_t)(e < 0 ? -e : e) > (dll->e2 >> 17)) {
+			/* More than half a period off, start over. */
+			dll->valid = false;
+			dll->state = 1;
+			break;
+		}
+		dll->t0 = dll->t1;
+		dll->t1 += ((int64_t)dll->b * e >> 32) + (dll->e2 >> 16);
+		dll->e2 += (int64_t)dll->c * e >> 16;
+		dll->pos0 = pos;
+		break;
+	}
+	dll->last = stamp;
+
+	seqc_write_end(&dll->seqc);
+}
+
+static void
+hdspe_intr(struct sc_info *sc, uint32_t periods, uint32_t pos,
+    uint64_t stamp)
+{
+	struct sc_pcminfo *scp;
+	struct hdspe_trace_entry *te;
+	uint32_t advance, expected, head, status1;
+	uint64_t now, cycles, xruns;
+	uint16_t flags;
+	char buf[32];
+	bool restart;
+	int i;
+
+	snd_mtxlock(sc->lock);
+	sc->lock_stamp = get_cyclecount();
+	sc->lock_cycles = 0;
+	sc->intr_copy_cycles = 0;
+
+	SDT_PROBE3(hdspe, , intr, entry, sc, periods, pos);
+
+	sc->period_stamp = stamp;
+	hdspe_hist_add(&sc->hist_wakeup, sc->lock_stamp - stamp);
+
+	flags = 0;
+	xruns = sc->xruns;
+	restart = !sc->period_pos_valid || periods != 1;
+
+	/* Hardware advanced further than the periods interrupted for. */
+	if (sc->period_pos_valid && sc->period > 0) {
+		advance = (pos + HDSPE_CHANBUF_SAMPLES - sc->period_pos) %
+		    HDSPE_CHANBUF_SAMPLES;
+		expected = periods * sc->period + sc->period / 2;
+		if (advance > expected) {
+			flags |= HDSPE_TRACE_MISSED;
+			sc->missed_periods += howmany(advance - expected,
+			    sc->period);
+			if (sc->xrun_events) {
+				snprintf(buf, sizeof(buf), "missed=%u",
+				    howmany(advance - expected, sc->period));
+				devctl_notify("HDSPE",
+				    device_get_nameunit(sc->dev), "MISSED",
+				    buf);
+			}
 		}
+	}
+	sc->period_pos = pos;
+	sc->period_pos_valid = true;
+
+	hdspe_dll_update(sc, stamp, pos, restart ||
+	    (flags & HDSPE_TRACE_MISSED) != 0);
+
+	for (i = 0; i < sc->npcm; i++) {
+		/* Skip idle pcm devices. */
+		if ((sc->running & HDSPE_RUN_PCM(i)) == 0)
+			continue;
+		scp = sc->pcm[i];
+		if (scp->ih != NULL)
+			scp->ih(scp);
+	}
 
-		hdspe_write_1(sc, HDSPE_INTERRUPT_ACK, 0);
-		free(devlist, M_TEMP);
+	/* Wake up raw device clients waiting for the period. */
+	sc->period_count += periods;
+	nanouptime(&sc->period_time);
+	if (sc->raw_open)
+		wakeup(&sc->period_count);
+
+	status1 = hdspe_read_4(sc, HDSPE_STATUS1_REG);
+	hdspe_status_update(sc, status1);
+
+	now = get_cyclecount();
+	hdspe_hist_add(&sc->hist_intr, now - stamp);
+
+	/* Lock hold time, without the chn_intr() calls that drop it. */
+	cycles = sc->lock_cycles + now - sc->lock_stamp;
+	counter_u64_add(sc->st_lock_cycles, cycles);
+	sc->lock_cycles_max = MAX(sc->lock_cycles_max, cycles);
+
+	/* Trace this interrupt, keep the history up to the first xrun. */
+	if (sc->xruns != xruns)
+		flags |= HDSPE_TRACE_XRUN;
+	if (sc->trace_frozen == 0) {
+		head = sc->trace_head;
+		te = &sc->trace[head & (HDSPE_TRACE_ENTRIES - 1)];
+		te->stamp = stamp;
+		te->cycles = sc->intr_copy_cycles;
+		te->status1 = status1;
+		te->running = sc->running;
+		te->position = pos;
+		te->flags = flags;
+		atomic_store_rel_32(&sc->trace_head, head + 1);
+		if (flags != 0)
+			atomic_store_rel_32(&sc->trace_frozen, 1);
 	}
 
+	SDT_PROBE2(hdspe, , intr, return, sc, now - stamp);
+
 	snd_mtxunlock(sc->lock);
 }
 
+static void
+hdspe_intr_thread(void *p)
+{
+	struct sc_info *sc;
+	uint32_t periods, pos;
+	uint64_t stamp;
+	int cpu, pri;
+
+	sc = (struct sc_info *)p;
+
+	thread_lock(curthread);
+	sched_class(curthread, PRI_ITHD);
+	thread_unlock(curthread);
+
+	mtx_lock_spin(&sc->intr_mtx);
+	while (!sc->intr_exit) {
+		if (sc->intr_update) {
+			/* Apply CPU binding and priority set by sysctl. */
+			cpu = sc->intr_cpu;
+			pri = sc->intr_priority;
+			sc->intr_update = false;
+			mtx_unlock_spin(&sc->intr_mtx);
+
+			thread_lock(curthread);
+			if (cpu == NOCPU)
+				sched_unbind(curthread);
+			else
+				sched_bind(curthread, cpu);
+			sched_prio(curthread, pri);
+			thread_unlock(curthread);
+
+			mtx_lock_spin(&sc->intr_mtx);
+			continue;
+		}
+		if (sc->intr_pending == 0) {
+			msleep_spin(&sc->intr_pending, &sc->intr_mtx,
+			    "hdspei", 0);
+			continue;
+		}
+		/* Periods coalesced while busy are copied in one go. */
+		periods = sc->intr_pending;
+		pos = sc->intr_pos;
+		stamp = sc->intr_stamp;
+		sc->intr_pending = 0;
+		mtx_unlock_spin(&sc->intr_mtx);
+
+		hdspe_intr(sc, periods, pos, stamp);
+
+		mtx_lock_spin(&sc->intr_mtx);
+	}
+	sc->intr_td = NULL;
+	wakeup(&sc->intr_td);
+	mtx_unlock_spin(&sc->intr_mtx);
+
+	kthread_exit();
+}
+
+static void
+hdspe_intr_thread_stop(struct sc_info *sc)
+{
+
+	mtx_lock_spin(&sc->intr_mtx);
+	sc->intr_exit = true;
+	wakeup_one(&sc->intr_pending);
+	while (sc->intr_td != NULL)
+		msleep_spin(&sc->intr_td, &sc->intr_mtx, "hdspex", 0);
+	mtx_unlock_spin(&sc->intr_mtx);
+}
+
+/* Record the bus address of each DMA buffer page for the page table. */
 static void
 hdspe_dmapsetmap(void *arg, bus_dma_segment_t *segs, int nseg, int error)
 {
-#if 0
-	device_printf(sc->dev, "hdspe_dmapsetmap()\n");
-#endif
+	uint32_t *pages;
+	int i;
+
+	if (error != 0)
+		return;
+
+	pages = arg;
+	for (i = 0; i < nseg; i++) {
+		KASSERT(segs[i].ds_len == HDSPE_PAGE_SIZE,
+		    ("hdspe: DMA segment %d not a page", i));
+		pages[i] = segs[i].ds_addr;
+	}
+}
+
+static void
+hdspe_dmascratch(void *arg, bus_dma_segment_t *segs, int nseg, int error)
+{
+	struct sc_info *sc;
+
+	sc = arg;
+	if (error == 0)
+		sc->scratch_addr = segs[0].ds_addr;
 }
 
 static int
 hdspe_alloc_resources(struct sc_info *sc)
 {
+	int count;
 
 	/* Allocate resource. */
 	sc->csid = PCIR_BAR(0);
@@ -163,29 +513,47 @@ hdspe_alloc_resources(struct sc_info *sc)
 	sc->cst = rman_get_bustag(sc->cs);
 	sc->csh = rman_get_bushandle(sc->cs);
 
-	/* Allocate interrupt resource. */
+	/* Allocate interrupt resource, prefer MSI over shared INTx. */
 	sc->irqid = 0;
+	sc->msi = false;
+	if (hdspe_msi != 0 && pci_msi_count(sc->dev) > 0) {
+		count = 1;
+		if (pci_alloc_msi(sc->dev, &count) == 0) {
+			sc->irqid = 1;
+			sc->msi = true;
+		}
+	}
+	if (hdspe_msi == 2 && !sc->msi) {
+		device_printf(sc->dev, "Unable to allocate MSI.\n");
+		return (ENXIO);
+	}
 	sc->irq = bus_alloc_resource_any(sc->dev, SYS_RES_IRQ, &sc->irqid,
-	    RF_ACTIVE | RF_SHAREABLE);
+	    sc->msi ? RF_ACTIVE : RF_ACTIVE | RF_SHAREABLE);
 
 	if (!sc->irq ||
 	    bus_setup_intr(sc->dev, sc->irq, INTR_MPSAFE | INTR_TYPE_AV,
-		NULL, hdspe_intr, sc, &sc->ih)) {
+		hdspe_filter, NULL, sc, &sc->ih)) {
 		device_printf(sc->dev, "Unable to alloc interrupt resource.\n");
 		return (ENXIO);
 	}
 
-	/* Allocate DMA resources. */
+	/*
+	 * Allocate DMA resources, only for the slots of the card model. The
+	 * hardware has a page table, so the buffers don't need to be
+	 * physically contiguous. One segment per page.
+	 */
+	sc->bufsize = HDSPE_CHANBUF_SIZE * sc->slots;
+
 	if (bus_dma_tag_create(/*parent*/bus_get_dma_tag(sc->dev),
-		/*alignment*/4,
-		/*boundary*/0,
+		/*alignment*/HDSPE_PAGE_SIZE,
+		/*boundary*/HDSPE_PAGE_SIZE,
 		/*lowaddr*/BUS_SPACE_MAXADDR_32BIT,
 		/*highaddr*/BUS_SPACE_MAXADDR,
 		/*filter*/NULL,
 		/*filterarg*/NULL,
-		/*maxsize*/2 * HDSPE_DMASEGSIZE,
-		/*nsegments*/2,
-		/*maxsegsz*/HDSPE_DMASEGSIZE,
+		/*maxsize*/sc->bufsize,
+		/*nsegments*/sc->bufsize / HDSPE_PAGE_SIZE,
+		/*maxsegsz*/HDSPE_PAGE_SIZE,
 		/*flags*/0,
 		/*lockfunc*/NULL,
 		/*lockarg*/NULL,
@@ -194,37 +562,37 @@ hdspe_alloc_resources(struct sc_info *sc)
 		return (ENXIO);
 	}
 
-	sc->bufsize = HDSPE_DMASEGSIZE;
-
-	/* pbuf (play buffer). */
-	if (bus_dmamem_alloc(sc->dmat, (void **)&sc->pbuf, BUS_DMA_WAITOK,
-	    &sc->pmap)) {
-		device_printf(sc->dev, "Can't alloc pbuf.\n");
-		return (ENXIO);
-	}
-
-	if (bus_dmamap_load(sc->dmat, sc->pmap, sc->pbuf, sc->bufsize,
-	    hdspe_dmapsetmap, sc, BUS_DMA_NOWAIT)) {
-		device_printf(sc->dev, "Can't load pbuf.\n");
+	/* Scratch page, shared by all page table entries of absent slots. */
+	if (bus_dma_tag_create(/*parent*/bus_get_dma_tag(sc->dev),
+		/*alignment*/HDSPE_PAGE_SIZE,
+		/*boundary*/0,
+		/*lowaddr*/BUS_SPACE_MAXADDR_32BIT,
+		/*highaddr*/BUS_SPACE_MAXADDR,
+		/*filter*/NULL,
+		/*filterarg*/NULL,
+		/*maxsize*/HDSPE_PAGE_SIZE,
+		/*nsegments*/1,
+		/*maxsegsz*/HDSPE_PAGE_SIZE,
+		/*flags*/0,
+		/*lockfunc*/NULL,
+		/*lockarg*/NULL,
+		/*dmatag*/&sc->scratch_dmat) != 0) {
+		device_printf(sc->dev, "Unable to create scratch dma tag.\n");
 		return (ENXIO);
 	}
 
-	/* rbuf (rec buffer). */
-	if (bus_dmamem_alloc(sc->dmat, (void **)&sc->rbuf, BUS_DMA_WAITOK,
-	    &sc->rmap)) {
-		device_printf(sc->dev, "Can't alloc rbuf.\n");
+	if (bus_dmamem_alloc(sc->scratch_dmat, (void **)&sc->scratch,
+	    BUS_DMA_WAITOK | BUS_DMA_ZERO, &sc->scratch_map)) {
+		device_printf(sc->dev, "Can't alloc scratch page.\n");
 		return (ENXIO);
 	}
 
-	if (bus_dmamap_load(sc->dmat, sc->rmap, sc->rbuf, sc->bufsize,
-	    hdspe_dmapsetmap, sc, BUS_DMA_NOWAIT)) {
-		device_printf(sc->dev, "Can't load rbuf.\n");
+	if (bus_dmamap_load(sc->scratch_dmat, sc->scratch_map, sc->scratch,
+	    HDSPE_PAGE_SIZE, hdspe_dmascratch, sc, BUS_DMA_NOWAIT)) {
+		device_printf(sc->dev, "Can't load scratch page.\n");
 		return (ENXIO);
 	}
 
-	bzero(sc->pbuf, sc->bufsize);
-	bzero(sc->rbuf, sc->bufsize);
-
 	return (0);
 }
 
@@ -234,15 +602,373 @@ hdspe_map_dmabuf(struct sc_info *sc)
 	uint32_t paddr, raddr;
 	int i;
 
-	paddr = vtophys(sc->pbuf);
-	raddr = vtophys(sc->rbuf);
+	/*
+	 * Pages of slots the card doesn't have point to the scratch page, as
+	 * do all pages while the buffers are not allocated.
+	 */
+	for (i = 0; i < HDSPE_MAX_SLOTS * HDSPE_SLOT_PAGES; i++) {
+		if (sc->pbuf != NULL && i < sc->slots * HDSPE_SLOT_PAGES) {
+			paddr = sc->ppages[i];
+			raddr = sc->rpages[i];
+		} else
+			paddr = raddr = sc->scratch_addr;
+		hdspe_write_4(sc, HDSPE_PAGE_ADDR_BUF_OUT + 4 * i, paddr);
+		hdspe_write_4(sc, HDSPE_PAGE_ADDR_BUF_IN + 4 * i, raddr);
+	}
+}
+
+static void
+hdspe_dmafree(struct sc_info *sc)
+{
+	uint32_t *pbuf, *rbuf;
 
-	for (i = 0; i < HDSPE_MAX_SLOTS * 16; i++) {
-		hdspe_write_4(sc, HDSPE_PAGE_ADDR_BUF_OUT + 4 * i,
-                    paddr + i * 4096);
-		hdspe_write_4(sc, HDSPE_PAGE_ADDR_BUF_IN + 4 * i,
-                    raddr + i * 4096);
+	/* Point the page tables to the scratch page before freeing. */
+	pbuf = sc->pbuf;
+	rbuf = sc->rbuf;
+	sc->rbuf = sc->pbuf = NULL;
+	hdspe_map_dmabuf(sc);
+
+	if (pbuf != NULL) {
+		bus_dmamap_unload(sc->dmat, sc->pmap);
+		bus_dmamem_free(sc->dmat, pbuf, sc->pmap);
+	}
+	if (rbuf != NULL) {
+		bus_dmamap_unload(sc->dmat, sc->rmap);
+		bus_dmamem_free(sc->dmat, rbuf, sc->rmap);
+	}
+}
+
+/*
+ * Allocate and map the DMA buffers if not present, with lock held. Called
+ * from channel trigger and open paths that can't sleep, so the allocation
+ * fails with ENOMEM under memory pressure instead of waiting.
+ */
+int
+hdspe_dma_start(struct sc_info *sc)
+{
+
+	if (sc->pbuf != NULL)
+		return (0);
+
+	if (bus_dmamem_alloc(sc->dmat, (void **)&sc->pbuf,
+	    BUS_DMA_NOWAIT | BUS_DMA_ZERO, &sc->pmap) != 0 ||
+	    bus_dmamem_alloc(sc->dmat, (void **)&sc->rbuf,
+	    BUS_DMA_NOWAIT | BUS_DMA_ZERO, &sc->rmap) != 0 ||
+	    bus_dmamap_load(sc->dmat, sc->pmap, sc->pbuf, sc->bufsize,
+	    hdspe_dmapsetmap, sc->ppages, BUS_DMA_NOWAIT) != 0 ||
+	    bus_dmamap_load(sc->dmat, sc->rmap, sc->rbuf, sc->bufsize,
+	    hdspe_dmapsetmap, sc->rpages, BUS_DMA_NOWAIT) != 0) {
+		device_printf(sc->dev, "Can't allocate DMA buffers.\n");
+		hdspe_dmafree(sc);
+		return (ENOMEM);
+	}
+
+	hdspe_map_dmabuf(sc);
+
+	return (0);
+}
+
+/* Free the DMA buffers if still idle after the timeout. */
+static void
+hdspe_dma_task(void *arg, int pending)
+{
+	struct sc_info *sc;
+
+	sc = arg;
+
+	snd_mtxlock(sc->lock);
+	/* Mapped buffers stay until the last mapping is gone. */
+	if (sc->dma_idle_timeout >= 0 &&
+	    atomic_load_acq_32(&sc->running) == 0 &&
+	    !sc->raw_open && sc->raw_mapped == 0)
+		hdspe_dmafree(sc);
+	snd_mtxunlock(sc->lock);
+}
+
+/* Schedule release of the DMA buffers when idle, with lock held. */
+void
+hdspe_dma_idle(struct sc_info *sc)
+{
+
+	if (sc->dma_idle_timeout < 0 ||
+	    atomic_load_acq_32(&sc->running) != 0 || sc->raw_open ||
+	    sc->raw_mapped != 0)
+		return;
+
+	taskqueue_enqueue_timeout(taskqueue_thread, &sc->dma_task,
+	    sc->dma_idle_timeout * hz);
+}
+
+static void
+hdspe_raw_enable(struct sc_info *sc, int value)
+{
+	int slot;
+
+	/* Enable all slots, route playback slots to outputs at unity gain. */
+	for (slot = 0; slot < sc->slots; slot++) {
+		hdspe_write_1(sc, HDSPE_OUT_ENABLE_BASE + (4 * slot), value);
+		hdspe_write_1(sc, HDSPE_IN_ENABLE_BASE + (4 * slot), value);
+		hdspe_write_4(sc, HDSPE_MIXER_BASE +
+		    ((64 + slot + 128 * slot) * sizeof(uint32_t)),
+		    value ? HDSPE_MAX_GAIN : 0);
 	}
+
+	if (value) {
+		sc->ctrl_register |= (HDSPE_AUDIO_INT_ENABLE | HDSPE_ENABLE);
+		sc->period_pos_valid = false;
+		hdspe_dll_reset(sc);
+	} else
+		sc->ctrl_register &= ~(HDSPE_AUDIO_INT_ENABLE | HDSPE_ENABLE);
+	hdspe_write_4(sc, HDSPE_CONTROL_REG, sc->ctrl_register);
+}
+
+static int
+hdspe_raw_open(struct cdev *cdev, int flags, int fmt, struct thread *td)
+{
+	struct sc_info *sc;
+	int err;
+
+	sc = cdev->si_drv1;
+	err = 0;
+
+	/* Exclusive access, no pcm channels may run concurrently. */
+	snd_mtxlock(sc->lock);
+	if (sc->detaching)
+		err = ENXIO;
+	else if (sc->raw_open || sc->raw_mapped != 0 || sc->running != 0)
+		err = EBUSY;
+	else if ((err = hdspe_dma_start(sc)) == 0) {
+		sc->raw_open = true;
+		hdspe_raw_enable(sc, 1);
+	}
+	snd_mtxunlock(sc->lock);
+
+	return (err);
+}
+
+static int
+hdspe_raw_close(struct cdev *cdev, int flags, int fmt, struct thread *td)
+{
+	struct sc_info *sc;
+
+	sc = cdev->si_drv1;
+
+	snd_mtxlock(sc->lock);
+	hdspe_raw_enable(sc, 0);
+	sc->raw_open = false;
+	wakeup(&sc->period_count);
+	hdspe_dma_idle(sc);
+	snd_mtxunlock(sc->lock);
+
+	return (0);
+}
+
+static int
+hdspe_raw_ioctl(struct cdev *cdev, u_long cmd, caddr_t data, int fflag,
+    struct thread *td)
+{
+	struct hdspe_period *period;
+	struct sc_info *sc;
+	uint64_t count;
+	int err;
+
+	sc = cdev->si_drv1;
+	err = 0;
+
+	switch (cmd) {
+	case HDSPE_IOC_WAIT:
+		period = (struct hdspe_period *)data;
+		snd_mtxlock(sc->lock);
+		/* Wait for the next period interrupt, time out after 1s. */
+		count = sc->period_count;
+		while (err == 0 && sc->raw_open && sc->period_count == count)
+			err = mtx_sleep(&sc->period_count, sc->lock, PCATCH,
+			    "hdspep", hz);
+		/* Closed or detached meanwhile, no new period to report. */
+		if (err == 0 && !sc->raw_open)
+			err = ENXIO;
+		if (err == 0) {
+			period->position = sc->period_pos;
+			period->period = sc->period;
+			period->count = sc->period_count;
+			period->timestamp = sc->period_time;
+		}
+		snd_mtxunlock(sc->lock);
+		if (err == EWOULDBLOCK)
+			err = ETIMEDOUT;
+		break;
+	default:
+		err = ENOTTY;
+		break;
+	}
+
+	return (err);
+}
+
+static int
+hdspe_raw_pager_ctor(void *handle, vm_ooffset_t size, vm_prot_t prot,
+    vm_ooffset_t foff, struct ucred *cred, u_short *color)
+{
+	struct sc_info *sc;
+
+	sc = handle;
+
+	/*
+	 * Keep the DMA buffers and the card exclusive while mapped. Counted
+	 * per pager object, a new object's constructor may run before the
+	 * destructor of the previous one.
+	 */
+	snd_mtxlock(sc->lock);
+	if (sc->detaching) {
+		snd_mtxunlock(sc->lock);
+		return (EBUSY);
+	}
+	sc->raw_mapped++;
+	snd_mtxunlock(sc->lock);
+
+	*color = 0;
+
+	return (0);
+}
+
+static void
+hdspe_raw_pager_dtor(void *handle)
+{
+	struct sc_info *sc;
+
+	sc = handle;
+
+	/* Last mapping of this object is gone, release the buffers if idle. */
+	snd_mtxlock(sc->lock);
+	KASSERT(sc->raw_mapped > 0, ("hdspe: raw_mapped underflow"));
+	sc->raw_mapped--;
+	hdspe_dma_idle(sc);
+	snd_mtxunlock(sc->lock);
+}
+
+static int
+hdspe_raw_pager_fault(vm_object_t object, vm_ooffset_t offset, int prot,
+    vm_page_t *mres)
+{
+	struct sc_info *sc;
+	vm_paddr_t paddr;
+	vm_page_t page;
+	uint32_t *buf;
+
+	sc = object->handle;
+
+	/*
+	 * Play and record DMA buffers at fixed offsets. They aren't freed
+	 * while mapped, so skip the softc lock, which would reverse the lock
+	 * order with the object lock held here.
+	 */
+	if (offset >= HDSPE_MMAP_REC_OFFSET) {
+		buf = sc->rbuf;
+		offset -= HDSPE_MMAP_REC_OFFSET;
+	} else {
+		buf = sc->pbuf;
+		offset -= HDSPE_MMAP_PLAY_OFFSET;
+	}
+
+	if (buf == NULL || offset >= sc->bufsize)
+		return (VM_PAGER_FAIL);
+	paddr = vtophys((char *)buf + offset);
+
+	/* Install a fake page for the physical address, as the device pager. */
+	if (((*mres)->flags & PG_FICTITIOUS) != 0) {
+		page = *mres;
+		vm_page_updatefake(page, paddr, VM_MEMATTR_DEFAULT);
+	} else {
+		VM_OBJECT_WUNLOCK(object);
+		page = vm_page_getfake(paddr, VM_MEMATTR_DEFAULT);
+		VM_OBJECT_WLOCK(object);
+		vm_page_replace(page, object, (*mres)->pindex, *mres);
+		*mres = page;
+	}
+	vm_page_valid(page);
+
+	return (VM_PAGER_OK);
+}
+
+static struct cdev_pager_ops hdspe_raw_pager_ops = {
+	.cdev_pg_fault =	hdspe_raw_pager_fault,
+	.cdev_pg_ctor =		hdspe_raw_pager_ctor,
+	.cdev_pg_dtor =		hdspe_raw_pager_dtor,
+};
+
+static int
+hdspe_raw_mmap_single(struct cdev *cdev, vm_ooffset_t *offset, vm_size_t size,
+    struct vm_object **object, int nprot)
+{
+	struct sc_info *sc;
+	vm_object_t obj;
+
+	sc = cdev->si_drv1;
+
+	if (*offset + size > HDSPE_MMAP_REC_OFFSET + HDSPE_DMASEGSIZE)
+		return (EINVAL);
+
+	/*
+	 * One pager object per device, mappings share it. The object is
+	 * torn down with the last mapping, unlike d_mmap page mappings.
+	 */
+	obj = cdev_pager_allocate(sc, OBJT_DEVICE, &hdspe_raw_pager_ops,
+	    HDSPE_MMAP_REC_OFFSET + HDSPE_DMASEGSIZE, nprot, 0,
+	    curthread->td_ucred);
+	if (obj == NULL)
+		return (EINVAL);
+	*object = obj;
+
+	return (0);
+}
+
+static int
+hdspe_status_mmap_single(struct cdev *cdev, vm_ooffset_t *offset,
+    vm_size_t size, struct vm_object **object, int nprot)
+{
+	struct sc_info *sc;
+
+	sc = cdev->si_drv1;
+
+	/* Single status page, read-only. */
+	if (*offset != HDSPE_MMAP_STATUS_OFFSET || size > PAGE_SIZE ||
+	    (nprot & PROT_WRITE) != 0)
+		return (EINVAL);
+
+	/* Mappings hold a reference, the page outlives detach. */
+	vm_object_reference(sc->status_obj);
+	*object = sc->status_obj;
+
+	return (0);
+}
+
+static int
+hdspe_sysctl_dma_idle_timeout(SYSCTL_HANDLER_ARGS)
+{
+	struct sc_info *sc = oidp->oid_arg1;
+	int error;
+	int timeout;
+
+	timeout = sc->dma_idle_timeout;
+
+	/* Process sysctl integer request. */
+	error = sysctl_handle_int(oidp, &timeout, 0, req);
+	if (error != 0 || req->newptr == NULL)
+		return (error);
+
+	if (timeout < -1 || timeout > INT_MAX / hz)
+		return (EINVAL);
+
+	/* Allocate right away if kept, otherwise reschedule release. */
+	snd_mtxlock(sc->lock);
+	sc->dma_idle_timeout = timeout;
+	if (timeout < 0)
+		error = hdspe_dma_start(sc);
+	else
+		hdspe_dma_idle(sc);
+	snd_mtxunlock(sc->lock);
+
+	return (error);
 }
 
 static int
@@ -305,6 +1031,88 @@ hdspe_sysctl_period(SYSCTL_HANDLER_ARGS)
 	return (0);
 }
 
+static int
+hdspe_sysctl_lookahead(SYSCTL_HANDLER_ARGS)
+{
+	struct sc_info *sc = oidp->oid_arg1;
+	int error;
+	unsigned int lookahead;
+
+	lookahead = sc->lookahead;
+
+	/* Process sysctl (unsigned) integer request. */
+	error = sysctl_handle_int(oidp, &lookahead, 0, req);
+	if (error != 0 || req->newptr == NULL)
+		return (error);
+
+	/* Copy at least one period ahead of playback, at most four. */
+	snd_mtxlock(sc->lock);
+	sc->lookahead = MAX(1, MIN(lookahead, 4));
+	snd_mtxunlock(sc->lock);
+
+	return (0);
+}
+
+static int
+hdspe_sysctl_intr_cpu(SYSCTL_HANDLER_ARGS)
+{
+	struct sc_info *sc = oidp->oid_arg1;
+	int error;
+	int cpu;
+
+	cpu = sc->intr_cpu;
+
+	/* Process sysctl integer request. */
+	error = sysctl_handle_int(oidp, &cpu, 0, req);
+	if (error != 0 || req->newptr == NULL)
+		return (error);
+
+	/* Accept any present CPU, or -1 to unbind. */
+	if (cpu != NOCPU &&
+	    (cpu < 0 || cpu > mp_maxid || CPU_ABSENT(cpu)))
+		return (EINVAL);
+
+	error = bus_bind_intr(sc->dev, sc->irq, cpu);
+	if (error != 0)
+		return (error);
+
+	/* The copy thread binds itself on the next wakeup. */
+	mtx_lock_spin(&sc->intr_mtx);
+	sc->intr_cpu = cpu;
+	sc->intr_update = true;
+	wakeup_one(&sc->intr_pending);
+	mtx_unlock_spin(&sc->intr_mtx);
+
+	return (0);
+}
+
+static int
+hdspe_sysctl_intr_priority(SYSCTL_HANDLER_ARGS)
+{
+	struct sc_info *sc = oidp->oid_arg1;
+	int error;
+	int pri;
+
+	pri = sc->intr_priority;
+
+	/* Process sysctl integer request. */
+	error = sysctl_handle_int(oidp, &pri, 0, req);
+	if (error != 0 || req->newptr == NULL)
+		return (error);
+
+	/* Stay within the interrupt thread priority range. */
+	if (pri < PRI_MIN_ITHD || pri > PRI_MAX_ITHD)
+		return (EINVAL);
+
+	mtx_lock_spin(&sc->intr_mtx);
+	sc->intr_priority = pri;
+	sc->intr_update = true;
+	wakeup_one(&sc->intr_pending);
+	mtx_unlock_spin(&sc->intr_mtx);
+
+	return (0);
+}
+
 static int
 hdspe_sysctl_clock_preference(SYSCTL_HANDLER_ARGS)
 {
@@ -351,6 +1159,7 @@ hdspe_sysctl_clock_preference(SYSCTL_HANDLER_ARGS)
 		sc->settings_register &= ~HDSPE_SETTING_CLOCK_MASK;
 		sc->settings_register |= setting;
 		hdspe_write_4(sc, HDSPE_SETTINGS_REG, sc->settings_register);
+		hdspe_status_update(sc, hdspe_read_4(sc, HDSPE_STATUS1_REG));
 		snd_mtxunlock(sc->lock);
 	}
 	return (0);
@@ -377,6 +1186,7 @@ hdspe_sysctl_clock_source(SYSCTL_HANDLER_ARGS)
 	/* Read current (autosync) clock source from status register. */
 	snd_mtxlock(sc->lock);
 	status = hdspe_read_4(sc, HDSPE_STATUS1_REG);
+	hdspe_status_update(sc, status);
 	status &= HDSPE_STATUS1_CLOCK_MASK;
 	snd_mtxunlock(sc->lock);
 
@@ -449,6 +1259,7 @@ hdspe_sysctl_sync_status(SYSCTL_HANDLER_ARGS)
 	/* Read current lock and sync bits from status register. */
 	snd_mtxlock(sc->lock);
 	status = hdspe_read_4(sc, HDSPE_STATUS1_REG);
+	hdspe_status_update(sc, status);
 	snd_mtxunlock(sc->lock);
 
 	/* List clock sources with lock and sync state. */
@@ -468,6 +1279,332 @@ hdspe_sysctl_sync_status(SYSCTL_HANDLER_ARGS)
 	return (sysctl_handle_string(oidp, buf, sizeof(buf), req));
 }
 
+static int
+hdspe_sysctl_hist(SYSCTL_HANDLER_ARGS)
+{
+	struct hdspe_hist hist;
+	char buf[1024];
+	int i, n;
+
+	/* Unlocked snapshot, a torn bucket is acceptable for statistics. */
+	memcpy(&hist, oidp->oid_arg1, sizeof(hist));
+	n = 0;
+	buf[0] = '\0';
+
+	/* List non-empty buckets as lower bound:count pairs. */
+	for (i = 0; i < HDSPE_HIST_BUCKETS; i++) {
+		if (hist.bucket[i] == 0)
+			continue;
+		if (n > 0)
+			n += strlcpy(buf + n, ",", sizeof(buf) - n);
+		n += snprintf(buf + n, sizeof(buf) - n, "%ju:%ju",
+		    i > 0 ? (uintmax_t)1 << (i - 1) : 0,
+		    (uintmax_t)hist.bucket[i]);
+	}
+	return (sysctl_handle_string(oidp, buf, sizeof(buf), req));
+}
+
+static int
+hdspe_sysctl_stats_reset(SYSCTL_HANDLER_ARGS)
+{
+	struct sc_info *sc = oidp->oid_arg1;
+	struct sc_pcminfo *scp;
+	int error;
+	int reset;
+	int i;
+
+	reset = 0;
+
+	/* Process sysctl integer request. */
+	error = sysctl_handle_int(oidp, &reset, 0, req);
+	if (error != 0 || req->newptr == NULL || reset == 0)
+		return (error);
+
+	snd_mtxlock(sc->lock);
+	bzero(&sc->hist_wakeup, sizeof(sc->hist_wakeup));
+	bzero(&sc->hist_intr, sizeof(sc->hist_intr));
+	sc->missed_periods = 0;
+	sc->xruns = 0;
+	for (i = 0; i < sc->npcm; i++) {
+		scp = sc->pcm[i];
+		bzero(&scp->hist_copy, sizeof(scp->hist_copy));
+		bzero(&scp->hist_done, sizeof(scp->hist_done));
+		scp->play_xruns = 0;
+		scp->rec_xruns = 0;
+	}
+	counter_u64_zero(sc->st_intr);
+	counter_u64_zero(sc->st_stray);
+	counter_u64_zero(sc->st_copies);
+	counter_u64_zero(sc->st_play_bytes);
+	counter_u64_zero(sc->st_rec_bytes);
+	counter_u64_zero(sc->st_copy_cycles);
+	counter_u64_zero(sc->st_lock_cycles);
+	sc->copy_cycles_max = 0;
+	sc->lock_cycles_max = 0;
+	snd_mtxunlock(sc->lock);
+
+	return (0);
+}
+
+static int
+hdspe_sysctl_trace(SYSCTL_HANDLER_ARGS)
+{
+	struct sc_info *sc = oidp->oid_arg1;
+	uint32_t head, n, first, chunk;
+	int error;
+
+	/* Oldest entries first, in at most two contiguous chunks. */
+	head = atomic_load_acq_32(&sc->trace_head);
+	n = MIN(head, HDSPE_TRACE_ENTRIES);
+	first = (head - n) & (HDSPE_TRACE_ENTRIES - 1);
+
+	if (req->oldptr == NULL)
+		return (SYSCTL_OUT(req, NULL, n * sizeof(*sc->trace)));
+
+	chunk = MIN(n, HDSPE_TRACE_ENTRIES - first);
+	error = SYSCTL_OUT(req, &sc->trace[first], chunk * sizeof(*sc->trace));
+	if (error == 0 && n > chunk)
+		error = SYSCTL_OUT(req, &sc->trace[0],
+		    (n - chunk) * sizeof(*sc->trace));
+
+	return (error);
+}
+
+static int
+hdspe_sysctl_trace_frozen(SYSCTL_HANDLER_ARGS)
+{
+	struct sc_info *sc = oidp->oid_arg1;
+	int error;
+	int frozen;
+
+	frozen = sc->trace_frozen;
+
+	/* Process sysctl integer request. */
+	error = sysctl_handle_int(oidp, &frozen, 0, req);
+	if (error != 0 || req->newptr == NULL)
+		return (error);
+
+	/* Freeze manually, or resume recording after an xrun. */
+	atomic_store_rel_32(&sc->trace_frozen, frozen != 0);
+
+	return (0);
+}
+
+static void
+hdspe_stats_alloc(struct sc_info *sc)
+{
+	vm_page_t m;
+
+	sc->st_intr = counter_u64_alloc(M_WAITOK);
+	sc->st_stray = counter_u64_alloc(M_WAITOK);
+	sc->st_copies = counter_u64_alloc(M_WAITOK);
+	sc->st_play_bytes = counter_u64_alloc(M_WAITOK);
+	sc->st_rec_bytes = counter_u64_alloc(M_WAITOK);
+	sc->st_copy_cycles = counter_u64_alloc(M_WAITOK);
+	sc->st_lock_cycles = counter_u64_alloc(M_WAITOK);
+	sc->trace = malloc(HDSPE_TRACE_ENTRIES * sizeof(*sc->trace),
+	    M_HDSPE, M_WAITOK | M_ZERO);
+
+	/* Status page owned by its own object, shared with the mappings. */
+	sc->status_obj = vm_pager_allocate(OBJT_PHYS, NULL, PAGE_SIZE,
+	    VM_PROT_DEFAULT, 0, NULL);
+	VM_OBJECT_WLOCK(sc->status_obj);
+	m = vm_page_grab(sc->status_obj, 0, VM_ALLOC_ZERO);
+	VM_OBJECT_WUNLOCK(sc->status_obj);
+	vm_page_valid(m);
+	vm_page_xunbusy(m);
+	sc->status_kva = kva_alloc(PAGE_SIZE);
+	pmap_qenter(sc->status_kva, &m, 1);
+	sc->status = (struct hdspe_status *)sc->status_kva;
+}
+
+static void
+hdspe_stats_free(struct sc_info *sc)
+{
+
+	counter_u64_free(sc->st_intr);
+	counter_u64_free(sc->st_stray);
+	counter_u64_free(sc->st_copies);
+	counter_u64_free(sc->st_play_bytes);
+	counter_u64_free(sc->st_rec_bytes);
+	counter_u64_free(sc->st_copy_cycles);
+	counter_u64_free(sc->st_lock_cycles);
+	free(sc->trace, M_HDSPE);
+
+	/* The page is freed with the object, after the last mapping. */
+	pmap_qremove(sc->status_kva, 1);
+	kva_free(sc->status_kva, PAGE_SIZE);
+	vm_object_deallocate(sc->status_obj);
+}
+
+static void
+hdspe_stats_attach(struct sc_info *sc)
+{
+	struct sysctl_ctx_list *ctx;
+	struct sysctl_oid *stats, *node;
+	struct sc_pcminfo *scp;
+	char name[8];
+	int i;
+
+	ctx = device_get_sysctl_ctx(sc->dev);
+	stats = SYSCTL_ADD_NODE(ctx,
+	    SYSCTL_CHILDREN(device_get_sysctl_tree(sc->dev)), OID_AUTO,
+	    "stats", CTLFLAG_RD | CTLFLAG_MPSAFE, NULL, "Statistics");
+
+	SYSCTL_ADD_PROC(ctx, SYSCTL_CHILDREN(stats), OID_AUTO,
+	    "reset", CTLTYPE_INT | CTLFLAG_WR | CTLFLAG_MPSAFE,
+	    sc, 0, hdspe_sysctl_stats_reset, "I",
+	    "Reset all statistics of the card");
+
+	SYSCTL_ADD_PROC(ctx, SYSCTL_CHILDREN(stats), OID_AUTO,
+	    "wakeup", CTLTYPE_STRING | CTLFLAG_RD | CTLFLAG_MPSAFE,
+	    &sc->hist_wakeup, 0, hdspe_sysctl_hist, "A",
+	    "Cycles from interrupt to copy thread (log2 histogram)");
+
+	SYSCTL_ADD_PROC(ctx, SYSCTL_CHILDREN(stats), OID_AUTO,
+	    "intr", CTLTYPE_STRING | CTLFLAG_RD | CTLFLAG_MPSAFE,
+	    &sc->hist_intr, 0, hdspe_sysctl_hist, "A",
+	    "Cycles from interrupt to all pcm devices serviced "
+	    "(log2 histogram)");
+
+	SYSCTL_ADD_COUNTER_U64(ctx, SYSCTL_CHILDREN(stats), OID_AUTO,
+	    "interrupts", CTLFLAG_RD, &sc->st_intr,
+	    "Interrupts taken");
+
+	SYSCTL_ADD_COUNTER_U64(ctx, SYSCTL_CHILDREN(stats), OID_AUTO,
+	    "stray", CTLFLAG_RD, &sc->st_stray,
+	    "Shared interrupts without audio interrupt pending");
+
+	SYSCTL_ADD_COUNTER_U64(ctx, SYSCTL_CHILDREN(stats), OID_AUTO,
+	    "copies", CTLFLAG_RD, &sc->st_copies,
+	    "Buffer copy invocations");
+
+	SYSCTL_ADD_COUNTER_U64(ctx, SYSCTL_CHILDREN(stats), OID_AUTO,
+	    "play_bytes", CTLFLAG_RD, &sc->st_play_bytes,
+	    "Bytes muxed into the playback DMA buffer");
+
+	SYSCTL_ADD_COUNTER_U64(ctx, SYSCTL_CHILDREN(stats), OID_AUTO,
+	    "rec_bytes", CTLFLAG_RD, &sc->st_rec_bytes,
+	    "Bytes demuxed from the record DMA buffer");
+
+	SYSCTL_ADD_COUNTER_U64(ctx, SYSCTL_CHILDREN(stats), OID_AUTO,
+	    "copy_cycles", CTLFLAG_RD, &sc->st_copy_cycles,
+	    "Total cycles spent copying");
+
+	SYSCTL_ADD_U64(ctx, SYSCTL_CHILDREN(stats), OID_AUTO,
+	    "copy_cycles_max", CTLFLAG_RD, &sc->copy_cycles_max, 0,
+	    "Maximum cycles of a single copy");
+
+	SYSCTL_ADD_COUNTER_U64(ctx, SYSCTL_CHILDREN(stats), OID_AUTO,
+	    "lock_cycles", CTLFLAG_RD, &sc->st_lock_cycles,
+	    "Total cycles the interrupt thread held the card lock");
+
+	SYSCTL_ADD_U64(ctx, SYSCTL_CHILDREN(stats), OID_AUTO,
+	    "lock_cycles_max", CTLFLAG_RD, &sc->lock_cycles_max, 0,
+	    "Maximum cycles the interrupt thread held the card lock");
+
+	SYSCTL_ADD_U64(ctx, SYSCTL_CHILDREN(stats), OID_AUTO,
+	    "missed_periods", CTLFLAG_RD, &sc->missed_periods, 0,
+	    "Periods the hardware advanced without an interrupt");
+
+	SYSCTL_ADD_U64(ctx, SYSCTL_CHILDREN(stats), OID_AUTO,
+	    "xruns", CTLFLAG_RD, &sc->xruns, 0,
+	    "Overruns and underruns of all channels");
+
+	for (i = 0; i < sc->npcm; i++) {
+		scp = sc->pcm[i];
+		snprintf(name, sizeof(name), "pcm%d", i);
+		node = SYSCTL_ADD_NODE(ctx, SYSCTL_CHILDREN(stats), OID_AUTO,
+		    name, CTLFLAG_RD | CTLFLAG_MPSAFE, NULL, scp->hc->descr);
+
+		SYSCTL_ADD_PROC(ctx, SYSCTL_CHILDREN(node), OID_AUTO,
+		    "copy", CTLTYPE_STRING | CTLFLAG_RD | CTLFLAG_MPSAFE,
+		    &scp->hist_copy, 0, hdspe_sysctl_hist, "A",
+		    "Cycles per buffer copy (log2 histogram)");
+
+		SYSCTL_ADD_PROC(ctx, SYSCTL_CHILDREN(node), OID_AUTO,
+		    "done", CTLTYPE_STRING | CTLFLAG_RD | CTLFLAG_MPSAFE,
+		    &scp->hist_done, 0, hdspe_sysctl_hist, "A",
+		    "Cycles from interrupt to chn_intr() return "
+		    "(log2 histogram)");
+
+		SYSCTL_ADD_U64(ctx, SYSCTL_CHILDREN(node), OID_AUTO,
+		    "play_xruns", CTLFLAG_RD, &scp->play_xruns, 0,
+		    "Hardware played past the copied samples");
+
+		SYSCTL_ADD_U64(ctx, SYSCTL_CHILDREN(node), OID_AUTO,
+		    "rec_xruns", CTLFLAG_RD, &scp->rec_xruns, 0,
+		    "Recorded samples exceeded the free pcm buffer");
+	}
+}
+
+static int
+hdspe_sysctl_status(SYSCTL_HANDLER_ARGS)
+{
+	struct sc_info *sc;
+	struct hdspe_clock_source *clock_table, *clock;
+	struct hdspe_card_status st;
+	uint32_t setting, source;
+	bool match;
+	int i;
+
+	sc = oidp->oid_arg1;
+
+	/* Select clock source table for device type. */
+	if (sc->type == HDSPE_AIO)
+		clock_table = hdspe_clock_source_table_aio;
+	else if (sc->type == HDSPE_RAYDAT)
+		clock_table = hdspe_clock_source_table_rd;
+	else
+		return (ENXIO);
+
+	bzero(&st, sizeof(st));
+	st.version = HDSPE_STATUS_VERSION;
+	st.size = sizeof(st);
+	st.type = sc->type == HDSPE_AIO ? HDSPE_STATUS_TYPE_AIO :
+	    HDSPE_STATUS_TYPE_RAYDAT;
+
+	/* Single snapshot of registers and state. */
+	snd_mtxlock(sc->lock);
+	st.status1 = hdspe_read_4(sc, HDSPE_STATUS1_REG);
+	st.settings = sc->settings_register;
+	st.speed = sc->speed;
+	st.period = sc->period;
+	st.force_speed = sc->force_speed;
+	st.force_period = sc->force_period;
+	st.running = sc->running;
+	st.raw_open = sc->raw_open;
+	hdspe_status_update(sc, st.status1);
+	snd_mtxunlock(sc->lock);
+
+	/* Translate clock sources in one pass over the table. */
+	setting = st.settings & HDSPE_SETTING_CLOCK_MASK;
+	source = st.status1 & HDSPE_STATUS1_CLOCK_MASK;
+	st.clock_source = HDSPE_STATUS_CLOCK_NONE;
+	st.clock_preference = HDSPE_STATUS_CLOCK_NONE;
+	for (clock = clock_table, i = 0;
+	    clock->name != NULL && i < HDSPE_STATUS_CLOCKS; ++clock, ++i) {
+		strlcpy(st.clock_names[i], clock->name,
+		    sizeof(st.clock_names[i]));
+		if (clock->setting == setting)
+			st.clock_preference = i;
+		/* In clock master mode, the internal clock is effective. */
+		if (st.settings & HDSPE_SETTING_MASTER)
+			match = (clock->setting & HDSPE_SETTING_MASTER) != 0;
+		else
+			match = (clock->status == source);
+		if (match && st.clock_source == HDSPE_STATUS_CLOCK_NONE)
+			st.clock_source = i;
+		if ((clock->lock_bit & st.status1) != 0)
+			st.clock_lock |= 1 << i;
+		if ((clock->sync_bit & st.status1) != 0)
+			st.clock_sync |= 1 << i;
+	}
+	st.clock_count = i;
+
+	return (SYSCTL_OUT(req, &st, sizeof(st)));
+}
+
 static int
 hdspe_probe(device_t dev)
 {
@@ -497,6 +1634,7 @@ hdspe_init(struct sc_info *sc)
 	/* Set latency. */
 	sc->period = 32;
 	sc->force_period = 128;	/* Force by default, pcm latency is broken. */
+	sc->lookahead = 1;
 	sc->ctrl_register = hdspe_encode_latency(7);
 
 	/* Set rate. */
@@ -529,30 +1667,31 @@ hdspe_init(struct sc_info *sc)
 static int
 hdspe_attach(device_t dev)
 {
+	struct make_dev_args devargs;
 	struct hdspe_channel *chan_map;
 	struct sc_pcminfo *scp;
 	struct sc_info *sc;
 	uint32_t rev;
 	int i, err;
 
-#if 1
-	device_printf(dev, "hdspe_attach()\n");
-#endif
-
 	sc = device_get_softc(dev);
 	sc->lock = snd_mtxcreate(device_get_nameunit(dev),
 	    "snd_hdspe softc");
 	sc->dev = dev;
+	mtx_init(&sc->intr_mtx, "hdspe intr", NULL, MTX_SPIN);
+	hdspe_stats_alloc(sc);
 
 	pci_enable_busmaster(dev);
 	rev = pci_get_revid(dev);
 	switch (rev) {
 	case PCI_REVISION_AIO:
 		sc->type = HDSPE_AIO;
+		sc->slots = HDSPE_AIO_SLOTS;
 		chan_map = hdspe_unified_pcm ? chan_map_aio_uni : chan_map_aio;
 		break;
 	case PCI_REVISION_RAYDAT:
 		sc->type = HDSPE_RAYDAT;
+		sc->slots = HDSPE_RAYDAT_SLOTS;
 		chan_map = hdspe_unified_pcm ? chan_map_rd_uni : chan_map_rd;
 		break;
 	default:
@@ -569,16 +1708,61 @@ hdspe_attach(device_t dev)
 	if (hdspe_init(sc) != 0)
 		return (ENXIO);
 
-	for (i = 0; i < HDSPE_MAX_CHANS && chan_map[i].descr != NULL; i++) {
-		scp = malloc(sizeof(struct sc_pcminfo), M_DEVBUF, M_NOWAIT | M_ZERO);
+	/* Copy thread, woken by the interrupt filter. */
+	sc->intr_cpu = NOCPU;
+	sc->intr_priority = MAX(PRI_MIN_ITHD,
+	    MIN(hdspe_intr_priority, PRI_MAX_ITHD));
+	sc->intr_update = true;
+	err = kthread_add(hdspe_intr_thread, sc, NULL, &sc->intr_td, 0, 0,
+	    "%s intr", device_get_nameunit(dev));
+	if (err) {
+		device_printf(dev, "Unable to create interrupt thread.\n");
+		return (ENXIO);
+	}
+
+	for (i = 0; i < HDSPE_MAX_PCM && chan_map[i].descr != NULL; i++) {
+		scp = malloc(sizeof(struct sc_pcminfo), M_DEVBUF, M_WAITOK | M_ZERO);
 		scp->hc = &chan_map[i];
 		scp->sc = sc;
+		scp->index = i;
 		scp->dev = device_add_child(dev, "pcm", -1);
 		device_set_ivars(scp->dev, scp);
+		sc->pcm[i] = scp;
 	}
 
+	snd_mtxlock(sc->lock);
+	sc->npcm = i;
+	snd_mtxunlock(sc->lock);
+
+	/* DMA buffers are allocated on first use, scratch page until then. */
+	sc->dma_idle_timeout = HDSPE_DMA_IDLE_TIMEOUT;
+	TIMEOUT_TASK_INIT(taskqueue_thread, &sc->dma_task, 0, hdspe_dma_task,
+	    sc);
 	hdspe_map_dmabuf(sc);
 
+	/* Raw device node for direct DMA buffer access. */
+	make_dev_args_init(&devargs);
+	devargs.mda_devsw = &hdspe_cdevsw;
+	devargs.mda_uid = UID_ROOT;
+	devargs.mda_gid = GID_OPERATOR;
+	devargs.mda_mode = 0660;
+	devargs.mda_si_drv1 = sc;
+	err = make_dev_s(&devargs, &sc->cdev, "hdspe%d", device_get_unit(dev));
+	if (err != 0)
+		device_printf(dev, "Unable to create device node.\n");
+
+	/* Status page device node, shared and read-only. */
+	make_dev_args_init(&devargs);
+	devargs.mda_devsw = &hdspe_status_cdevsw;
+	devargs.mda_uid = UID_ROOT;
+	devargs.mda_gid = GID_WHEEL;
+	devargs.mda_mode = 0444;
+	devargs.mda_si_drv1 = sc;
+	err = make_dev_s(&devargs, &sc->status_cdev, "hdspe%d.status",
+	    device_get_unit(dev));
+	if (err != 0)
+		device_printf(dev, "Unable to create status device node.\n");
+
 	SYSCTL_ADD_PROC(device_get_sysctl_ctx(dev),
 	    SYSCTL_CHILDREN(device_get_sysctl_tree(dev)), OID_AUTO,
 	    "sync_status", CTLTYPE_STRING | CTLFLAG_RD | CTLFLAG_MPSAFE,
@@ -603,6 +1787,12 @@ hdspe_attach(device_t dev)
 	    sc, 0, hdspe_sysctl_clock_list, "A",
 	    "List of supported clock sources");
 
+	SYSCTL_ADD_PROC(device_get_sysctl_ctx(dev),
+	    SYSCTL_CHILDREN(device_get_sysctl_tree(dev)), OID_AUTO,
+	    "status", CTLTYPE_OPAQUE | CTLFLAG_RD | CTLFLAG_MPSAFE,
+	    sc, 0, hdspe_sysctl_status, "S,hdspe_card_status",
+	    "Clock, sync, rate, period and running state (binary)");
+
 	SYSCTL_ADD_PROC(device_get_sysctl_ctx(dev),
 	    SYSCTL_CHILDREN(device_get_sysctl_tree(dev)), OID_AUTO,
 	    "period", CTLTYPE_UINT | CTLFLAG_RW | CTLFLAG_MPSAFE,
@@ -615,24 +1805,57 @@ hdspe_attach(device_t dev)
 	    sc, 0, hdspe_sysctl_speed, "A",
 	    "Force sample rate (32000, 44100, 48000, ... 192000)");
 
-	return (bus_generic_attach(dev));
-}
+	SYSCTL_ADD_PROC(device_get_sysctl_ctx(dev),
+	    SYSCTL_CHILDREN(device_get_sysctl_tree(dev)), OID_AUTO,
+	    "lookahead", CTLTYPE_UINT | CTLFLAG_RW | CTLFLAG_MPSAFE,
+	    sc, 0, hdspe_sysctl_lookahead, "IU",
+	    "Periods copied ahead of the playback position (1 ... 4)");
 
-static void
-hdspe_dmafree(struct sc_info *sc)
-{
+	SYSCTL_ADD_PROC(device_get_sysctl_ctx(dev),
+	    SYSCTL_CHILDREN(device_get_sysctl_tree(dev)), OID_AUTO,
+	    "intr_cpu", CTLTYPE_INT | CTLFLAG_RWTUN | CTLFLAG_MPSAFE,
+	    sc, 0, hdspe_sysctl_intr_cpu, "I",
+	    "Bind interrupt and copy thread to CPU (-1 for no binding)");
 
-	bus_dmamap_unload(sc->dmat, sc->rmap);
-	bus_dmamap_unload(sc->dmat, sc->pmap);
-	bus_dmamem_free(sc->dmat, sc->rbuf, sc->rmap);
-	bus_dmamem_free(sc->dmat, sc->pbuf, sc->pmap);
-	sc->rbuf = sc->pbuf = NULL;
+	SYSCTL_ADD_PROC(device_get_sysctl_ctx(dev),
+	    SYSCTL_CHILDREN(device_get_sysctl_tree(dev)), OID_AUTO,
+	    "intr_priority", CTLTYPE_INT | CTLFLAG_RWTUN | CTLFLAG_MPSAFE,
+	    sc, 0, hdspe_sysctl_intr_priority, "I",
+	    "Scheduling priority of the interrupt copy thread");
+
+	SYSCTL_ADD_PROC(device_get_sysctl_ctx(dev),
+	    SYSCTL_CHILDREN(device_get_sysctl_tree(dev)), OID_AUTO,
+	    "trace", CTLTYPE_OPAQUE | CTLFLAG_RD | CTLFLAG_MPSAFE,
+	    sc, 0, hdspe_sysctl_trace, "S,hdspe_trace_entry",
+	    "Interrupt trace, struct hdspe_trace_entry oldest first");
+
+	SYSCTL_ADD_PROC(device_get_sysctl_ctx(dev),
+	    SYSCTL_CHILDREN(device_get_sysctl_tree(dev)), OID_AUTO,
+	    "trace_frozen", CTLTYPE_INT | CTLFLAG_RW | CTLFLAG_MPSAFE,
+	    sc, 0, hdspe_sysctl_trace_frozen, "I",
+	    "Interrupt trace stopped at xrun (set 0 to resume)");
+
+	SYSCTL_ADD_BOOL(device_get_sysctl_ctx(dev),
+	    SYSCTL_CHILDREN(device_get_sysctl_tree(dev)), OID_AUTO,
+	    "xrun_events", CTLFLAG_RWTUN, &sc->xrun_events, 0,
+	    "Report xruns and missed periods to devd(8)");
+
+	SYSCTL_ADD_PROC(device_get_sysctl_ctx(dev),
+	    SYSCTL_CHILDREN(device_get_sysctl_tree(dev)), OID_AUTO,
+	    "dma_idle_timeout", CTLTYPE_INT | CTLFLAG_RWTUN | CTLFLAG_MPSAFE,
+	    sc, 0, hdspe_sysctl_dma_idle_timeout, "I",
+	    "Free DMA buffers after idle seconds (-1 to keep allocated)");
+
+	hdspe_stats_attach(sc);
+
+	return (bus_generic_attach(dev));
 }
 
 static int
 hdspe_detach(device_t dev)
 {
 	struct sc_info *sc;
+	int i, npcm;
 	int err;
 
 	sc = device_get_softc(dev);
@@ -641,22 +1864,72 @@ hdspe_detach(device_t dev)
 		return (0);
 	}
 
+	/* Mapped DMA buffers can't be revoked, refuse new mappings. */
+	snd_mtxlock(sc->lock);
+	if (sc->raw_mapped != 0) {
+		snd_mtxunlock(sc->lock);
+		return (EBUSY);
+	}
+	sc->detaching = true;
+
+	/* Stop dispatching interrupts to the pcm devices. */
+	npcm = sc->npcm;
+	sc->npcm = 0;
+	snd_mtxunlock(sc->lock);
+
 	err = device_delete_children(dev);
-	if (err)
+	if (err) {
+		snd_mtxlock(sc->lock);
+		sc->npcm = npcm;
+		sc->detaching = false;
+		snd_mtxunlock(sc->lock);
 		return (err);
+	}
 
-	hdspe_dmafree(sc);
+	for (i = 0; i < npcm; i++)
+		free(sc->pcm[i], M_DEVBUF);
+
+	/* destroy_dev() doesn't close the raw device, stop the card here. */
+	snd_mtxlock(sc->lock);
+	if (sc->raw_open) {
+		hdspe_raw_enable(sc, 0);
+		sc->raw_open = false;
+		wakeup(&sc->period_count);
+	}
+	snd_mtxunlock(sc->lock);
+
+	if (sc->cdev)
+		destroy_dev(sc->cdev);
+	if (sc->status_cdev)
+		destroy_dev(sc->status_cdev);
 
 	if (sc->ih)
 		bus_teardown_intr(dev, sc->irq, sc->ih);
+	if (sc->intr_td)
+		hdspe_intr_thread_stop(sc);
+
+	taskqueue_drain_timeout(taskqueue_thread, &sc->dma_task);
+	hdspe_dmafree(sc);
+	if (sc->scratch != NULL) {
+		bus_dmamap_unload(sc->scratch_dmat, sc->scratch_map);
+		bus_dmamem_free(sc->scratch_dmat, sc->scratch,
+		    sc->scratch_map);
+	}
+
 	if (sc->dmat)
 		bus_dma_tag_destroy(sc->dmat);
+	if (sc->scratch_dmat)
+		bus_dma_tag_destroy(sc->scratch_dmat);
 	if (sc->irq)
-		bus_release_resource(dev, SYS_RES_IRQ, 0, sc->irq);
+		bus_release_resource(dev, SYS_RES_IRQ, sc->irqid, sc->irq);
+	if (sc->msi)
+		pci_release_msi(dev);
 	if (sc->cs)
 		bus_release_resource(dev, SYS_RES_MEMORY, PCIR_BAR(0), sc->cs);
 	if (sc->lock)
 		snd_mtxfree(sc->lock);
+	mtx_destroy(&sc->intr_mtx);
+	hdspe_stats_free(sc);
 
 	return (0);
 }
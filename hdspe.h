@@ -44,6 +44,7 @@
 /* Buffer */
 #define	HDSPE_PAGE_ADDR_BUF_OUT		8192
 #define	HDSPE_PAGE_ADDR_BUF_IN		(HDSPE_PAGE_ADDR_BUF_OUT + 64 * 16 * 4)
+#define	HDSPE_PAGE_SIZE			4096 /* DMA page table granularity */
 #define	HDSPE_BUF_POSITION_MASK		0x000FFC0
 
 /* Frequency */
@@ -68,8 +69,8 @@
 #define	HDSPE_LAT_1			(1 << 2)
 #define	HDSPE_LAT_2			(1 << 3)
 #define	HDSPE_LAT_MASK			(HDSPE_LAT_0 | HDSPE_LAT_1 | HDSPE_LAT_2)
-#define	HDSPE_LAT_BYTES_MAX		(4096 * 4)
-#define	HDSPE_LAT_BYTES_MIN		(32 * 4)
+#define	HDSPE_LAT_SAMPLES_MAX		4096
+#define	HDSPE_LAT_SAMPLES_MIN		32
 #define	hdspe_encode_latency(x)		(((x)<<1) & HDSPE_LAT_MASK)
 
 /* Gain */
@@ -110,11 +111,21 @@
 
 /* Channels */
 #define	HDSPE_MAX_SLOTS			64 /* Mono channels */
+#define	HDSPE_AIO_SLOTS			20 /* Up to last ADAT slot */
+#define	HDSPE_RAYDAT_SLOTS		36
 #define	HDSPE_MAX_CHANS			(HDSPE_MAX_SLOTS / 2) /* Stereo pairs */
+#define	HDSPE_MAX_PCM			8 /* PCM devices per card */
+#define	HDSPE_MAX_FMTS			16 /* Capability formats, terminated */
+
+/* Running channel bits, one for play and one for rec per PCM device. */
+#define	HDSPE_RUN_BIT(pcm, chan)	(1 << ((pcm) * 2 + (chan)))
+#define	HDSPE_RUN_PCM(pcm)		(3 << ((pcm) * 2))
 
 #define	HDSPE_CHANBUF_SAMPLES		(16 * 1024)
 #define	HDSPE_CHANBUF_SIZE		(4 * HDSPE_CHANBUF_SAMPLES)
 #define	HDSPE_DMASEGSIZE		(HDSPE_CHANBUF_SIZE * HDSPE_MAX_SLOTS)
+#define	HDSPE_SLOT_PAGES		(HDSPE_CHANBUF_SIZE / HDSPE_PAGE_SIZE)
+#define	HDSPE_DMA_IDLE_TIMEOUT		60 /* Seconds until DMA buffers freed */
 
 #define	HDSPE_CHAN_AIO_LINE		(1 << 0)
 #define	HDSPE_CHAN_AIO_PHONE		(1 << 1)
@@ -146,6 +157,53 @@ struct hdspe_channel {
 	char		*descr;
 };
 
+/* Copy plan, runs of contiguous DMA slots mapped to pcm channels. */
+#define	HDSPE_MAX_SEGS			8
+
+struct hdspe_copy_seg {
+	uint32_t	slot;
+	uint32_t	chan;
+	uint32_t	slots;
+};
+
+/* Log2 histogram of cycle counts, bucket n holds [2^(n-1), 2^n). */
+#define	HDSPE_HIST_BUCKETS		32
+
+struct hdspe_hist {
+	uint64_t	bucket[HDSPE_HIST_BUCKETS];
+};
+
+#define	hdspe_hist_add(h, delta)					\
+	((h)->bucket[MIN(flsll(delta), HDSPE_HIST_BUCKETS - 1)]++)
+
+/*
+ * Delay-locked loop of the period interrupts, times in cycles. Written by
+ * the interrupt thread, read locklessly through the sequence counter.
+ */
+#define	HDSPE_DLL_2PI_Q32		26986075409ULL	/* 2 pi, Q32 */
+#define	HDSPE_DLL_SQRT2_Q16		92682		/* sqrt(2), Q16 */
+#define	HDSPE_DLL_BANDWIDTH		1		/* Hz */
+
+struct hdspe_dll {
+	seqc_t		seqc;
+	bool		valid;
+	uint64_t	t0;		/* Start of the current period. */
+	uint64_t	t1;		/* Predicted start of the next period. */
+	uint32_t	pos0;		/* Hardware position at t0. */
+	uint32_t	period;
+	uint32_t	speed;
+
+	/* Writer only */
+	int		state;
+	uint64_t	last;		/* Previous interrupt. */
+	uint64_t	e2;		/* Period length, Q16. */
+	uint64_t	b;		/* Loop coefficients, Q32. */
+	uint64_t	c;
+};
+
+/* Interrupt trace ring entries, a power of two. */
+#define	HDSPE_TRACE_ENTRIES		4096
+
 /* Clock sources */
 #define	HDSPE_SETTING_MASTER		(1 << 0)
 #define	HDSPE_SETTING_CLOCK_MASK	0x1f
@@ -165,6 +223,8 @@ struct hdspe_clock_source {
 
 static MALLOC_DEFINE(M_HDSPE, "hdspe", "hdspe audio");
 
+SDT_PROVIDER_DECLARE(hdspe);
+
 /* Channel registers */
 struct sc_chinfo {
 	struct snd_dbuf		*buffer;
@@ -173,7 +233,7 @@ struct sc_chinfo {
 
 	/* Channel information */
 	struct pcmchan_caps	*caps;
-	uint32_t	cap_fmts[4];
+	uint32_t	cap_fmts[HDSPE_MAX_FMTS];
 	uint32_t	dir;
 	uint32_t	format;
 	uint32_t	ports;
@@ -181,11 +241,19 @@ struct sc_chinfo {
 	uint32_t	rvol;
 
 	/* Buffer */
-	uint32_t	*data;
+	uint8_t		*data;
 	uint32_t	size;
 
+	/* Copy plan */
+	struct hdspe_copy_seg	segs[HDSPE_MAX_SEGS];
+	uint32_t	nsegs;
+	uint32_t	channels;
+	uint32_t	copied;
+	uint32_t	copy_valid;
+
 	/* Flags */
 	uint32_t	run;
+	uint32_t	runbit;
 };
 
 /* PCM device private data */
@@ -193,7 +261,16 @@ struct sc_pcminfo {
 	device_t		dev;
 	uint32_t		(*ih) (struct sc_pcminfo *scp);
 	uint32_t		chnum;
+	uint32_t		index;
 	struct sc_chinfo	chan[HDSPE_MAX_CHANS];
+
+	/* Copy and interrupt to chn_intr() return cycles */
+	struct hdspe_hist	hist_copy;
+	struct hdspe_hist	hist_done;
+
+	/* Hardware overtook the copied data */
+	uint64_t		play_xruns;
+	uint64_t		rec_xruns;
 	struct sc_info		*sc;
 	struct hdspe_channel	*hc;
 };
@@ -216,6 +293,18 @@ struct sc_info {
 	struct resource		*irq;
 	int			irqid;
 	void			*ih;
+	bool			msi;
+
+	/* Interrupt filter to copy thread handoff */
+	struct mtx		intr_mtx;
+	struct thread		*intr_td;
+	uint32_t		intr_pending;
+	uint32_t		intr_pos;
+	uint64_t		intr_stamp;
+	int			intr_cpu;
+	int			intr_priority;
+	bool			intr_update;
+	bool			intr_exit;
 	bus_dma_tag_t		dmat;
 
 	/* Play/Record DMA buffers */
@@ -224,10 +313,71 @@ struct sc_info {
 	uint32_t		bufsize;
 	bus_dmamap_t		pmap;
 	bus_dmamap_t		rmap;
+	unsigned int		slots;
+	int			dma_idle_timeout;
+	struct timeout_task	dma_task;
+	uint32_t		ppages[HDSPE_MAX_SLOTS * HDSPE_SLOT_PAGES];
+	uint32_t		rpages[HDSPE_MAX_SLOTS * HDSPE_SLOT_PAGES];
+
+	/* Scratch page backing absent slots in the DMA page tables */
+	bus_dma_tag_t		scratch_dmat;
+	bus_dmamap_t		scratch_map;
+	uint32_t		*scratch;
+	bus_addr_t		scratch_addr;
 	uint32_t		period;
 	uint32_t		speed;
 	uint32_t		force_period;
 	uint32_t		force_speed;
+	uint32_t		lookahead;
+
+	/* PCM devices, fixed table for the interrupt handler. */
+	struct sc_pcminfo	*pcm[HDSPE_MAX_PCM];
+	int			npcm;
+	volatile uint32_t	running;
+
+	/* Statistics, filter to copy thread and to copy end cycles */
+	uint64_t		period_stamp;
+	struct hdspe_hist	hist_wakeup;
+	struct hdspe_hist	hist_intr;
+	uint64_t		missed_periods;
+	uint64_t		xruns;
+	bool			xrun_events;
+
+	/* Statistics, per-CPU counters and maxima under lock */
+	counter_u64_t		st_intr;
+	counter_u64_t		st_stray;
+	counter_u64_t		st_copies;
+	counter_u64_t		st_play_bytes;
+	counter_u64_t		st_rec_bytes;
+	counter_u64_t		st_copy_cycles;
+	counter_u64_t		st_lock_cycles;
+	uint64_t		copy_cycles_max;
+	uint64_t		lock_cycles_max;
+	uint64_t		lock_stamp;
+	uint64_t		lock_cycles;
+	uint64_t		intr_copy_cycles;
+
+	/* Smoothed period timing for getptr */
+	struct hdspe_dll	dll;
+
+	/* Interrupt trace ring, single writer, frozen on xrun */
+	struct hdspe_trace_entry *trace;
+	volatile uint32_t	trace_head;
+	volatile uint32_t	trace_frozen;
+
+	/* Raw device node */
+	struct cdev		*cdev;
+	struct cdev		*status_cdev;
+	struct hdspe_status	*status;
+	struct vm_object	*status_obj;
+	vm_offset_t		status_kva;
+	bool			raw_open;
+	u_int			raw_mapped;	/* Pager objects */
+	bool			detaching;
+	uint64_t		period_count;
+	uint32_t		period_pos;
+	bool			period_pos_valid;
+	struct timespec		period_time;
 };
 
 #define	hdspe_read_1(sc, regno)						\
@@ -243,3 +393,17 @@ struct sc_info {
 	bus_space_write_2((sc)->cst, (sc)->csh, (regno), (data))
 #define	hdspe_write_4(sc, regno, data)					\
 	bus_space_write_4((sc)->cst, (sc)->csh, (regno), (data))
+
+/* Current hardware buffer position in samples. */
+#define	hdspe_hw_position(sc)						\
+	((hdspe_read_2(sc, HDSPE_STATUS_REG) & HDSPE_BUF_POSITION_MASK) / 4)
+
+/* DMA buffers on demand, with the card lock held. */
+int	hdspe_dma_start(struct sc_info *sc);
+void	hdspe_dma_idle(struct sc_info *sc);
+
+/* Restart the period interrupt loop, with the card lock held. */
+void	hdspe_dll_reset(struct sc_info *sc);
+
+/* Refresh the mmap'ed status page from STATUS1, with the card lock held. */
+void	hdspe_status_update(struct sc_info *sc, uint32_t status1);
@@ -0,0 +1,133 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Userspace interface of the raw HDSPe device node, /dev/hdspeN, and of the
+ * binary sysctls under dev.hdspe.N.
+ */
+
+#ifndef _HDSPE_IOCTL_H_
+#define _HDSPE_IOCTL_H_
+
+#include <sys/types.h>
+#include <sys/ioccom.h>
+#include <sys/time.h>
+
+/*
+ * The DMA buffers are mapped at fixed offsets, sized for 64 slots (mono
+ * channels) of 16384 samples, 32 bit little endian, one slot after another.
+ * Only the slots of the card are backed: 20 on AIO, 36 on RayDAT.
+ */
+#define	HDSPE_MMAP_PLAY_OFFSET		0
+#define	HDSPE_MMAP_REC_OFFSET		(64 * 16384 * 4)
+
+/* Period interrupt information. */
+struct hdspe_period {
+	uint32_t	position;	/* Hardware buffer position (samples). */
+	uint32_t	period;		/* Samples per period. */
+	uint64_t	count;		/* Period interrupts since attach. */
+	struct timespec	timestamp;	/* System uptime of the interrupt. */
+};
+
+/*
+ * Block until the next period interrupt. Fails with ETIMEDOUT after one
+ * second without interrupt, and with ENXIO if the device is closed or
+ * detached meanwhile.
+ */
+#define	HDSPE_IOC_WAIT			_IOR('H', 1, struct hdspe_period)
+
+/*
+ * Status page, mmap'ed read-only from /dev/hdspeN.status and updated at
+ * every period interrupt. While idle, it is refreshed on channel start and
+ * stop, settings changes and status sysctl reads; position and timestamp
+ * are those of the last interrupt. The sequence number is odd while an
+ * update is in progress. Readers copy the page and retry if the sequence
+ * number was odd or changed meanwhile.
+ */
+#define	HDSPE_MMAP_STATUS_OFFSET	0
+
+struct hdspe_status {
+	uint32_t	seq;		/* Sequence number. */
+	uint32_t	position;	/* Hardware buffer position (samples). */
+	uint64_t	period_count;	/* Period interrupts since attach. */
+	struct timespec	timestamp;	/* System uptime of the interrupt. */
+	uint32_t	status1;	/* Clock, lock and sync status bits. */
+	uint32_t	speed;		/* Effective sample rate. */
+	uint32_t	period;		/* Samples per period. */
+	uint32_t	running;	/* Running channels bitmask. */
+};
+
+/*
+ * Interrupt trace, read from the dev.hdspe.N.trace sysctl as an array of
+ * entries, oldest first. Recording stops at the first xrun or missed period
+ * until dev.hdspe.N.trace_frozen is set to 0 again. Read while not frozen,
+ * the oldest entries may be overwritten by the interrupt thread meanwhile.
+ */
+#define	HDSPE_TRACE_XRUN		0x0001	/* Channel xrun detected. */
+#define	HDSPE_TRACE_MISSED		0x0002	/* Periods missed. */
+
+struct hdspe_trace_entry {
+	uint64_t	stamp;		/* Cycle count at interrupt. */
+	uint32_t	cycles;		/* Cycles copying buffers. */
+	uint32_t	status1;	/* Clock, lock and sync status bits. */
+	uint32_t	running;	/* Running channels bitmask. */
+	uint16_t	position;	/* Hardware buffer position (samples). */
+	uint16_t	flags;		/* HDSPE_TRACE_* */
+};
+
+/*
+ * Card status, read from the dev.hdspe.N.status sysctl. Taken from a single
+ * register snapshot, clock sources are indices into clock_names.
+ */
+#define	HDSPE_STATUS_VERSION		1
+#define	HDSPE_STATUS_CLOCKS		16
+#define	HDSPE_STATUS_CLOCK_NAMELEN	12
+#define	HDSPE_STATUS_CLOCK_NONE		0xffffffff
+
+#define	HDSPE_STATUS_TYPE_AIO		0
+#define	HDSPE_STATUS_TYPE_RAYDAT	1
+
+struct hdspe_card_status {
+	uint32_t	version;	/* HDSPE_STATUS_VERSION */
+	uint32_t	size;		/* Size of this structure. */
+	uint32_t	type;		/* HDSPE_STATUS_TYPE_* */
+	uint32_t	status1;	/* Clock, lock and sync status bits. */
+	uint32_t	settings;	/* Settings register. */
+	uint32_t	clock_count;	/* Entries in clock_names. */
+	uint32_t	clock_source;	/* Currently effective clock source. */
+	uint32_t	clock_preference; /* Internal or preferred autosync. */
+	uint32_t	clock_lock;	/* Valid signal, bit per clock source. */
+	uint32_t	clock_sync;	/* Synchronized, bit per clock source. */
+	uint32_t	speed;		/* Sample rate. */
+	uint32_t	period;		/* Samples per period. */
+	uint32_t	force_speed;	/* Sample rate forced by sysctl, or 0. */
+	uint32_t	force_period;	/* Period forced by sysctl, or 0. */
+	uint32_t	running;	/* Running channels bitmask. */
+	uint32_t	raw_open;	/* Raw device node in use. */
+	char		clock_names[HDSPE_STATUS_CLOCKS]
+			    [HDSPE_STATUS_CLOCK_NAMELEN];
+};
+
+#endif /* _HDSPE_IOCTL_H_ */